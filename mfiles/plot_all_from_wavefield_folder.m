@@ -11,6 +11,8 @@ close all;
 
 addpath('./subroutines');
 
+fmt = 'ascii';      % 'ascii', 'binary', 'hdf5' or 'compressed', the same as -snapshot_format of the run
+
 % h1 = figure('units','normalized','outerposition',[0 0 1 1]);
 h1 = figure;
 WinOnTop(h1);
@@ -18,11 +20,12 @@ WinOnTop(h1);
 for ii = 1:35
     kf = ii * 2;
     name = ['../wavefields/10Hz_128/tmp_Bvec_' num2str(kf)];
-    run(name);
+    v = load_wavefield(name, fmt);
 
     %%
-    dim = int8(round(abs(max(size(Vec_0x84000004_0))))^(1/3));
-    u = reshape(Vec_0x84000004_0, dim, dim, dim);
+    % Full cube; for -snapshot_slice or -snapshot_stride use the sub-volume size printed by the run instead
+    dim = round(numel(v)^(1/3));
+    u = reshape(v, dim, dim, dim);
 
     % u = resample3Dimage(u, 2);
 
@@ -9,6 +9,13 @@ addpath('./subroutines');
 c_file=mfilename('fullpath');       %current path to this running script
 c_file=strrep(c_file,mfilename,''); %remove name of script from path to get path to folder
 pathh=[c_file '../seism/'];        %redirect to the folder with data files
+
+if exist([pathh 'seis.bin'], 'file')   %single binary file from -seis_format binary
+   D = load_seismograms([pathh 'seis.bin']);
+   wiggle(D);
+   return;
+end
+
 fileList=dir(pathh); %get list of files to compare => number must be EVEN (2*n=even)
 fileList = fileList(~[fileList.isdir]); %remove hidden directories (like . and ..)
 
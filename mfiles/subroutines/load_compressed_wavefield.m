@@ -0,0 +1,56 @@
+% Decode a compressed snapshot of p3D_acoustic (-snapshot_format compressed) into a column vector
+% in natural DMDA ordering (X fastest), |u - u_original| <= tol at every node, tol = -snapshot_tolerance * max|u|.
+%
+% file - e.g. '../wavefields/tmp_Bvec_50.cwf'
+%
+% Every rank block holds LEB128 varints: 2*zigzag(q)+1 for a residual code q ~= 0, 2*n for n zero codes.
+% The residual of the Lorenzo predictor is the mixed difference of the reconstruction along X, Y and Z,
+% zero outside of the block, so the block is recovered by a cumulative sum along each axis
+
+function u = load_compressed_wavefield(file)
+
+fid = fopen(file, 'r', 'ieee-be');
+head = fread(fid, 5, 'int32');
+if head(1) ~= 1129791302
+    error([file ' is not a compressed snapshot']);
+end
+nranks = head(2);
+n = head(3:5)';
+tol = fread(fid, 1, 'float64');
+
+box = zeros(nranks, 6);
+where = zeros(nranks, 2);
+for r = 1:nranks
+    box(r, :) = fread(fid, 6, 'int32')';
+    where(r, :) = fread(fid, 2, 'int64')';
+end
+
+u = zeros(n);
+for r = 1:nranks
+    fseek(fid, where(r, 1), 'bof');
+    b = fread(fid, where(r, 2), 'uint8=>double');
+
+    % Varints, a byte below 128 ends one
+    last = (b < 128);
+    tok = cumsum([1; last(1:end-1)]);
+    first = [1; find(last(1:end-1)) + 1];
+    pos = (1:numel(b))' - first(tok);
+    v = accumarray(tok, mod(b, 128) .* 128.^pos);
+
+    % Literal codes and runs of zeros
+    lit = (mod(v, 2) == 1);
+    zz = (v - 1) / 2;
+    q = zeros(size(v));
+    q(lit) = (mod(zz(lit), 2) == 0) .* zz(lit) / 2 - (mod(zz(lit), 2) == 1) .* (zz(lit) + 1) / 2;
+    len = ones(size(v));
+    len(~lit) = v(~lit) / 2;
+    q = repelem(q, len);
+
+    xm = box(r, 4); ym = box(r, 5); zm = box(r, 6);
+    block = reshape(2 * tol * q, xm, ym, zm);
+    block = cumsum(cumsum(cumsum(block, 1), 2), 3);
+    u(box(r, 1) + (1:xm), box(r, 2) + (1:ym), box(r, 3) + (1:zm)) = block;
+end
+fclose(fid);
+
+u = u(:);
@@ -0,0 +1,31 @@
+% Load the seismograms written by p3D_acoustic with -seis_format binary.
+% Only the time steps flushed so far are returned, so a file from a run that
+% died before the end is still readable.
+%
+% name - file name, e.g. '../seism/seis.bin'
+%
+% D   - samples [nsteps nrec], one column per receiver
+% t   - time of every row, t = (it-1)*dt
+% pos - receiver positions in grid points [irec jrec krec]
+
+function [D, t, pos] = load_seismograms(name)
+
+fid = fopen(name, 'r', 'ieee-be');
+if fid < 0
+    error(['Cannot open ' name]);
+end
+
+head = fread(fid, 4, 'int32');
+if head(1) ~= 1397049683                % 'SEIS'
+    fclose(fid);
+    error([name ' is not a seismogram file']);
+end
+nrec   = head(2);
+nsteps = head(4);                       % steps written, nt once the run is complete
+dt     = fread(fid, 1, 'float64');
+pos    = reshape(fread(fid, 3*nrec, 'int32'), nrec, 3);
+
+D = fread(fid, [nrec nsteps], 'float32')';   % file is [nt][nrec], time-major
+fclose(fid);
+
+t = (0:nsteps-1)' * dt;
@@ -0,0 +1,30 @@
+% Load a wavefield snapshot written by p3D_acoustic as a column vector
+% in natural DMDA ordering (X fastest), whatever -snapshot_format was used.
+%
+% name - file name without extension, e.g. '../wavefields/tmp_Bvec_50'
+% fmt  - 'ascii' (.m), 'binary' (.bin, PETSc binary), 'hdf5' (.h5) or 'compressed' (.cwf, lossy)
+%
+% The binary reader PetscBinaryRead.m ships with PETSc in $PETSC_DIR/share/petsc/matlab
+
+function u = load_wavefield(name, fmt)
+
+switch fmt
+    case 'ascii'
+        run(name);
+        vars = who('Vec_*');                % VecView names the vector after its address
+        u = eval(vars{1});
+
+    case 'binary'
+        addpath(fullfile(getenv('PETSC_DIR'), 'share', 'petsc', 'matlab'));
+        u = PetscBinaryRead([name '.bin']);
+
+    case 'hdf5'
+        u = h5read([name '.h5'], '/u');     % [NX NY NZ] in MATLAB order
+        u = u(:);
+
+    case 'compressed'
+        u = load_compressed_wavefield([name '.cwf']);
+
+    otherwise
+        error(['Unknown snapshot format ' fmt]);
+end
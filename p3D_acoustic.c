@@ -0,0 +1,4166 @@
+
+/*
+  3D acoustic wave propagation in homogeneous isotropic media, using PETSc
+  2017
+
+  PETSc - Portable, Extensible Toolkit for Scientific Computation
+  https://www.mcs.anl.gov/petsc/
+
+  # TECH DETAILS:
+    Finite-Differences in Time Domain (FDTD)
+    Implicit time stepping
+    O(2,2), O(2,4), O(2,6) or O(2,8), chosen with -order
+    Schemes derived from Taylor series: in space e.g. [1:-2:1]/dx2 or [-1:16:-30:16:-1]/12dx2, in time [2:-5:4:-1]/dt2
+
+  # HOW TO USE: (PETSc has to be installed)
+    make all
+    ./run_O22.sh or ./run_O24.sh
+
+
+
+  Author: Oleg Ovcharenko, PhD student at KAUST (ErSE, ECRC)
+  Email:  oleg.ovcharenko@kaust.edu.sa
+*/
+
+#include <stdio.h>
+#include <petscdmda.h>
+#include <petscksp.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+#define debprint(expr) PetscPrintf(PETSC_COMM_WORLD, #expr " = %f \n", expr);
+
+// Constants
+#define PI 3.1415926535
+#define DEGREES_TO_RADIANS PI/180.f
+#define STENCIL_MAX_RADIUS 4                    // Points on each side of a node for the highest order, O(2,8)
+#define ABC_DAMPING 0.3                         // Cerjan damping factor times the width, g = exp(-0.09) at the outer edge
+#define SEIS_FILE_MAGIC 1397049683              // "SEIS", first word of the binary seismogram file
+#define CKPT_FILE_MAGIC 1129009224              // "CKPH", first word of a checkpoint file
+#define CKPT_CLAIM_SLOT 999999                  // Slot named by ckpt_g<group>.latest for the marker of a new shot
+#define CWF_FILE_MAGIC 1129791302               // "CWAF", first word of a compressed snapshot
+
+// Threads of a rank share the (k, j) rows of its subdomain, with the same static schedule in every kernel
+// and in first_touch, so each thread works on the pages it placed. Nothing without -fopenmp (make OPENMP=1)
+#if defined(_OPENMP)
+#define OMP_FOR_ROWS _Pragma("omp parallel for collapse(2) schedule(static)")
+#else
+#define OMP_FOR_ROWS
+#endif
+
+//User-functions prototypes
+PetscErrorCode compute_A_u(KSP, Mat, Mat, void *);  // Build A, for Ax=b
+PetscErrorCode apply_A_u(Mat, Vec, Vec);            // Matrix-free y = A x
+PetscErrorCode diag_A_u(Mat, Vec);                  // Diagonal of the matrix-free A
+PetscErrorCode update_b_u(KSP, Vec, void *);        // Build b, for Ax=b
+PetscErrorCode update_b_vec(KSP, Vec, void *);      // Build b with Vec operations only, for device Vec types
+PetscErrorCode save_Vec_to_m_file(Vec, void *);     // Save wavefield into MATLAB .m file
+PetscErrorCode save_snapshot(Vec, void *);          // Save wavefield in the format chosen by -snapshot_format
+PetscErrorCode wavefield_stats(Vec, void *, PetscReal *); // Max, min and 2-norm of u in one reduction
+void           stats_reduce(void *, void *, int *, MPI_Datatype *); // MPI_Op of wavefield_stats
+PetscErrorCode snapshot_async_write(Vec, void *);   // Stage a binary snapshot and start a nonblocking write
+PetscErrorCode snapshot_async_progress(void *);     // Let outstanding snapshot writes progress
+PetscErrorCode snapshot_async_flush(void *);        // Complete all outstanding snapshot writes
+PetscErrorCode snapshot_compressed_write(Vec, void *); // Error-bounded lossy snapshot, one block per rank
+PetscErrorCode snapshot_subset_setup(DM, void *);   // Scatter of the slice or strided sub-volume of the snapshots
+void           swap_bytes(void *, size_t, PetscInt); // Byte order of PETSc binary files
+PetscErrorCode Save_seismograms_to_txt_files(KSP, void *);  // Save seism. to .txt files
+PetscErrorCode source_term(void *);                 // Compute source term for current time step
+PetscErrorCode wavelet_table(void *);               // Source time function of every step for the current DT
+PetscErrorCode source_locate(void *);               // Owned nodes of the point sources of the current shot
+PetscErrorCode read_text_table(const char *, PetscInt, PetscInt *, PetscScalar **); // Numbers of a text file, on all ranks
+PetscErrorCode Write_seismograms(KSP, Vec, void *); // Append new value to the seismograms
+PetscErrorCode explicit_step(KSP, Vec, void *);     // Explicit leapfrog update of u, no linear solve
+PetscErrorCode time_step(KSP, Vec, void *);         // Advance the wavefield to the current time step
+PetscErrorCode compare_schemes(KSP, Vec, void *, PetscInt, PetscScalar, PetscScalar); // Cost per step of both schemes
+PetscErrorCode locate_receivers(DM, void *);        // Find the receivers owned by this rank
+PetscErrorCode velocity_on_level(DM, void *, Vec *); // Squared velocity on a DMDA level, NULL if homogeneous
+PetscErrorCode build_sponge(void *);                // Damping profiles of the absorbing layer
+PetscErrorCode next_shot(void *);                   // Take the next shot from the queue shared by all groups
+PetscErrorCode seis_file_open(void *);              // Create the shared binary seismogram file
+PetscErrorCode seis_file_flush(void *);             // Write the buffered chunk of samples collectively
+PetscErrorCode seis_file_close(void *);             // Close the shared binary seismogram file
+PetscErrorCode accuracy_setup(void *);              // Analytic solution at the owned receivers for the current shot
+PetscErrorCode accuracy_report(void *);             // Misfit of the traces to the analytic solution
+PetscScalar ricker(PetscScalar, PetscScalar);       // Ricker wavelet of peak frequency f0, centered at 1.2/f0
+PetscErrorCode first_touch(DM, Vec);                // Place the array of a Vec on the NUMA nodes of the threads
+PetscErrorCode device_setup(DM, void *);            // Masks and receiver gather of the device path
+PetscErrorCode device_source(void *);               // Weights of the point sources of the current shot
+PetscErrorCode checkpoint_write(Vec, void *);       // Save the state after the current step, rotating the files
+PetscErrorCode checkpoint_open(void *, PetscViewer *); // Find the latest checkpoint and read its shot and step
+PetscErrorCode checkpoint_load(PetscViewer, Vec, void *); // Restore the wavefield and the receiver buffers
+PetscErrorCode rtm_replay(KSP, Vec, void *);        // Forward wavefield of the shot in reverse order
+PetscErrorCode rtm_reverse(KSP, Vec, void *, PetscInt, PetscInt, PetscInt, PetscInt); // Binomial reversal of (s, e]
+PetscErrorCode rtm_restore(void *, PetscInt, PetscInt); // State after step s from a slot, or the rest state
+PetscErrorCode rtm_advance(KSP, Vec, void *, PetscInt, PetscInt); // Recompute the steps from s to e
+PetscErrorCode rtm_consume(Vec, void *);            // Use the replayed wavefield of the current step
+PetscReal binomial(PetscInt, PetscInt);             // Steps reversible with c slots and r recomputations
+void           active_box(void *, PetscInt *);      // Nodes the explicit step has to update, the others stay zero
+void           active_mark(void *, PetscInt, PetscBool); // Box of a level after it is zeroed or overwritten
+
+/*
+  User-defined structures
+*/
+
+// Wavefield
+typedef struct {
+  Vec level[4];               // Pressure wavefield at T, T-1, T-2, T-3, rotated through by it modulo 4
+  PetscBool single;           // -history_float, the history is kept in float and only T is a Vec
+  float *hist[4];             // Float copies of the owned levels, rotated like level[], NULL without -history_float
+} wfield;
+
+// Wavefield at T-lag for time step it, lag = 0..3. Nothing is copied when the loop advances
+#define WF_LEVEL(wf, it, lag) ((wf).level[((it) + 4 - (lag)) % 4])
+#define WF_HIST(wf, it, lag) ((wf).hist[((it) + 4 - (lag)) % 4])
+#define WF_SLOT(it, lag) (((it) + 4 - (lag)) % 4)
+
+// Model parameters
+typedef struct {
+  PetscInt nx;                // Number of grid points along X
+  PetscInt ny;                
+  PetscInt nz;                
+  PetscScalar dx;             // Grid spacing [km]
+  PetscScalar dy;
+  PetscScalar dz;
+  PetscScalar xmax;           // Limits along OX, xmin ... xmax [km]
+  PetscScalar xmin;
+  PetscScalar ymax;
+  PetscScalar ymin;
+  PetscScalar zmax;
+  PetscScalar zmin;
+  PetscScalar vel;            // Wave propagation velocity [km/s]
+  Vec vel2;                   // Squared velocity per node [km2/s2] from -vel_file, NULL if homogeneous
+} model_par;
+
+typedef struct{
+  PetscScalar dt;             // Time step [s]
+  PetscScalar t0;
+  PetscScalar tmax;           // Total simulation time [s]
+  PetscScalar t;              // Current simulation time [s]
+  PetscInt it;                // Current simulation step
+  PetscInt nt;                // Total simulation steps
+  PetscScalar dt_stable;      // Largest stable time step of the explicit scheme [s]
+  PetscInt it0;               // Last step done by the checkpoint the shot resumes from, 0 for a fresh start
+  PetscInt steps;             // Time steps run by this group over all its shots, a resumed shot counts from it0
+} time_par;
+
+typedef struct{
+  PetscInt isrc;              // Source position, in grid points
+  PetscInt jsrc;
+  PetscInt ksrc;
+  PetscScalar factor;         // Source ampliturde
+  PetscScalar angle_force;
+  PetscScalar f0;             // Source frequency
+  PetscScalar fx;             // Force of the current step, the only component applied to the pressure
+} source;
+
+// Source time function and point sources shared by all shots. Every shot places the same points at offsets
+// from its own position, and each rank keeps the nodes it owns as offsets into its block of the DMDA Vecs
+typedef struct{
+  PetscScalar *wavelet;       // Source time function at (it - 1) DT, [nt + 1], built once for the DT of the run
+  PetscInt nfile;             // Samples of -wavelet_file, 0 for the Ricker wavelet
+  PetscScalar *file;          // -wavelet_file samples from t = 0
+  PetscScalar file_dt;        // -wavelet_dt, sampling interval of the file [s]
+  PetscInt npts;              // Point sources of every shot
+  PetscInt *di, *dj, *dk;     // Offsets from the shot position [grid points]
+  PetscScalar *w;             // Weights
+  PetscInt nloc;              // Owned point sources of the current shot, off the boundary layers
+  PetscInt *loc;              // Their offsets in the owned block, X fastest
+  PetscScalar *wloc;          // Their weights
+  PetscInt box[6];            // Bounding box of all the point sources of the current shot, {xs, xe, ys, ye, zs, ze}
+} source_par;
+
+typedef enum {SEIS_TXT, SEIS_BINARY} seismogram_format;
+
+typedef struct
+{
+  PetscInt nrec;              // Number of receivers
+  PetscInt *irec;             // Receiver positions, in grid points
+  PetscInt *jrec;
+  PetscInt *krec;
+  PetscInt nloc;              // Number of receivers owned by this rank
+  PetscInt *id;               // Global indices of the owned receivers
+  PetscInt *loc;              // Offsets of the owned receivers in the local part of u
+  PetscScalar *trace;         // Owned seismograms, receiver-major [nloc][nbuf], t = it*dt
+  seismogram_format format;   // One .txt file per receiver at the end, or one shared binary file
+  PetscInt nbuf;              // Samples buffered per receiver, nt for .txt files, the chunk for binary
+  MPI_File fh;                // Shared binary file
+  MPI_Datatype ftype;         // Owned columns of one time step in the [nt][nrec] layout of the file
+  MPI_Offset header;          // Header size in bytes
+  float *stage;               // Chunk transposed to time-major float32, big-endian
+  PetscBool check;            // -check_accuracy, compare the traces with the analytic homogeneous solution
+  PetscReal *dist;            // Source distance of the owned receivers [km]
+  PetscReal *amp;             // Amplitude of the analytic solution at the owned receivers
+  PetscReal *tvalid;          // Arrival of the first boundary reflection at the owned receivers [s]
+  PetscReal misfit[2];        // Local sums of the squared misfit and of the squared analytic trace
+} receivers;
+
+typedef struct{
+  PetscBool matfree;          // Apply A matrix-free through a MatShell instead of assembling it
+  PetscBool explicit_scheme;  // Leapfrog time stepping instead of the implicit solve
+  MatNullSpace nullspace;     // Constant null space attached to A once, NULL with Dirichlet boundaries
+  PetscInt guess_order;       // Order of the extrapolated initial guess from the history, 0 = zero guess
+  PetscBool log_its;          // Print the Krylov iteration count of every time step
+  PetscInt its;               // Krylov iterations of the last solve
+  PetscInt its_total;         // Krylov iterations accumulated over the run
+  DM da;                      // Mesh-object used by the matrix-free operator
+} solver_par;
+
+typedef enum {SNAPSHOT_ASCII, SNAPSHOT_BINARY, SNAPSHOT_HDF5, SNAPSHOT_COMPRESSED} snapshot_format;
+
+typedef struct{
+  PetscScalar *buf;           // Staging copy of the local block, in PETSc binary (big-endian) byte order
+  MPI_File fh;                // File being written from buf
+  MPI_Request req;            // Nonblocking MPI-IO write
+  PetscBool busy;             // The write from buf has not been completed yet
+} snapshot_slot;
+
+typedef struct{
+  PetscBool save;             // -save_wavefield, snapshots of the first shot every display_every steps
+  snapshot_format format;     // Wavefield snapshots as MATLAB .m text, PETSc binary, HDF5 or compressed
+  PetscReal tolerance;        // Error bound of compressed snapshots, relative to max |u| of the snapshot
+  PetscInt stride;            // -snapshot_stride, every stride-th node along each axis
+  PetscInt slice_axis;        // -snapshot_slice axis:index, 0, 1 or 2 for X, Y or Z, -1 for the whole volume
+  PetscInt slice_index;       // Grid index of the slice along slice_axis
+  PetscInt nsub[3];           // Size of the written sub-volume
+  Vec sub;                    // Sub-volume in its own natural ordering, NULL for the full grid
+  VecScatter pick;            // u to sub
+  PetscBool async;            // Binary snapshots written in the background while the time loop goes on
+  PetscInt nslots;            // Size of the bounded pool of staging buffers
+  PetscInt next;              // Slot to be used by the next snapshot
+  snapshot_slot *slots;
+} output_par;
+
+// Cerjan sponge, the wavefield is damped by g = gx[i] * gy[j] * gz[k] at every step
+typedef struct{
+  PetscInt width;             // Thickness of the absorbing layer in grid points, 0 for none
+  PetscScalar *g[3];          // Damping profiles along X, Y and Z, 1 outside of the layer
+} sponge;
+
+// Checkpoints, ./checkpoints/ckpt_g<group>_<slot>.bin with ckpt_g<group>.latest naming the newest slot
+typedef struct{
+  PetscInt every;             // -checkpoint_every steps, 0 for none
+  PetscInt keep;              // -checkpoint_keep files in rotation, the oldest one is overwritten
+  PetscInt count;             // Checkpoints written by this group
+} checkpoint_par;
+
+// Reverse replay for RTM, binomial checkpointing as in Revolve (Griewank and Walther, 2000).
+// The states of a few steps are held in memory and the steps in between are recomputed on demand
+typedef struct{
+  PetscBool on;               // -rtm, replay the forward wavefield of every shot backwards after it
+  PetscBool verify;           // -rtm_verify, check the replayed |u| against the forward pass
+  PetscInt nslots;            // States held in memory, -rtm_snaps or from -rtm_memory
+  Vec *slot;                  // T, T-1 and T-2 of each held state, [3 * nslots]
+  PetscInt steps;             // Forward steps recomputed by the replay of the current shot
+  PetscReal *norm;            // |u| of every forward step, [nt], to check the replay against, NULL without -rtm_verify
+  PetscReal deviation;        // Largest relative difference of the replayed |u|
+  Vec illum;                  // Source illumination, sum of u^2 over all steps
+} rtm_par;
+
+// Dynamic shot queue, MPI_COMM_WORLD is split into groups and each group is the PETSC_COMM_WORLD of its own
+typedef struct{
+  PetscMPIInt ngroups;        // Number of groups, -shot_groups
+  PetscMPIInt group;          // Group of this rank
+  MPI_Comm world;             // All ranks of the run
+  MPI_Win win;                // Exposes the shot counter of world rank 0
+  PetscMPIInt counter;        // Next shot to be taken, only used on world rank 0
+  PetscInt done;              // Shots run by this group
+} shot_queue;
+
+// Profiling, PETSc stages and events for -log_view, and the per-step table of -log_steps
+typedef struct{
+  PetscLogStage setup;        // Everything before the time loop
+  PetscLogStage loop;         // Time stepping of all shots
+  PetscLogStage output;       // Seismograms written at the end of a shot
+  PetscLogEvent rhs;          // update_b_u, with the predictor of the initial guess
+  PetscLogEvent solve;        // KSPSolve of one time step
+  PetscLogEvent leapfrog;     // explicit_step
+  PetscLogEvent seis;         // Write_seismograms
+  PetscLogEvent snapshot;     // save_snapshot
+  FILE *csv;                  // -log_steps file, NULL when not asked for
+  PetscInt display_every;     // -display_every steps between progress reports and snapshots, 0 for none
+  PetscBool display;          // -display, print the progress reports
+  PetscBool display_stats;    // -display_stats, report max, min and norm of u
+  MPI_Datatype stats_type;    // {max, min, sum of squares} of wavefield_stats
+  MPI_Op stats_op;
+} perf_log;
+
+// Spatial order. The kernels of every order are generated from p3D_acoustic_kernels.h below
+typedef PetscErrorCode (*explicit_kernel)(DMDALocalInfo *, const PetscScalar *, PetscScalar, const PetscScalar ***,
+                                          PetscScalar **, PetscScalar ***, const PetscScalar ***, 
+                                          const PetscScalar ***, const PetscInt *);   // Leapfrog over a box
+typedef PetscErrorCode (*apply_kernel)(DMDALocalInfo *, const PetscScalar *, PetscScalar, PetscScalar, 
+                                       const PetscScalar ***, const PetscScalar ***, PetscScalar ***);   // y = A x
+
+typedef struct{
+  PetscInt order;             // -order 2, 4, 6 or 8
+  PetscInt radius;            // Points on each side of a node, order / 2
+  const PetscScalar *d;       // h2 * u'' = d[0] u[0] + sum_m d[m] (u[m] + u[-m]), m = 1..radius
+  explicit_kernel explicit_box;
+  apply_kernel apply_box;
+} stencil_par;
+
+// Device path, taken when the Vec type of the DMDA does not live on the host (-dm_vec_type cuda, ...).
+// The time loop then builds b, the initial guess and the samples with Vec operations, which PETSc runs
+// where the data is, and host arrays are only touched at setup, at snapshots and for the nloc samples
+typedef struct{
+  PetscBool on;               // The global Vecs of the DMDA are not host Vecs
+  Vec interior;               // 1 on the interior nodes, 0 on the boundary layers
+  Vec g[3];                   // interior * g, g^2 and g^3 of the sponge, NULL without one
+  Vec delta;                  // 1 at the source node of the current shot
+  Vec work;                   // Scratch of update_b_vec
+  VecScatter gather;          // u at the owned receivers to rec_u
+  Vec rec_u;                  // Sequential host Vec of the nloc samples of one step
+} device_par;
+
+// Active region of the explicit scheme. Early in a shot the wave fills a small ball around the source,
+// so each step only sweeps the box that can hold nonzero nodes, the rest of the grid is known to be zero
+typedef struct{
+  PetscBool on;               // -active_region
+  PetscInt margin;            // -active_margin nodes added to the reach cmax * t / h of every axis
+  PetscScalar cmax;           // Fastest velocity of the model [km/s]
+  PetscInt n[3];              // Size of the grid
+  PetscInt box[4][6];         // Box of the nonzero nodes of every level, {xs, xe, ys, ye, zs, ze}, empty when xs == xe
+  PetscReal updated;          // Node updates swept in the active boxes
+  PetscReal full;             // Node updates of full-grid sweeps over the same steps
+} active_par;
+
+typedef struct {              // User context that gathers all the structures above
+  wfield wf;
+  model_par model;
+  time_par time;
+  source *src;                // Sources of all shots, the current one is src[shot]
+  source_par srcs;            // Wavelet table and point sources
+  PetscInt nshots;            // Number of shots, run one after the other with the same KSP
+  PetscInt shot;              // Current shot
+  receivers rec;
+  solver_par solver;
+  stencil_par stencil;
+  output_par out;
+  sponge abc;
+  shot_queue queue;
+  perf_log log;
+  device_par dev;
+  checkpoint_par ckpt;
+  rtm_par rtm;
+  active_par active;
+} ctx_t;
+
+
+typedef int bool;             // TRUE-FALSE definition
+#define true 1
+#define false 0
+
+// Kernels specialized for each spatial order, with the Taylor weights of the second derivative
+#define STENCIL_ORDER 2
+#define STENCIL_WEIGHTS {-2.0, 1.0}
+#include "p3D_acoustic_kernels.h"
+
+#define STENCIL_ORDER 4
+#define STENCIL_WEIGHTS {-30.0 / 12.0, 16.0 / 12.0, -1.0 / 12.0}
+#include "p3D_acoustic_kernels.h"
+
+#define STENCIL_ORDER 6
+#define STENCIL_WEIGHTS {-49.0 / 18.0, 3.0 / 2.0, -3.0 / 20.0, 1.0 / 90.0}
+#include "p3D_acoustic_kernels.h"
+
+#define STENCIL_ORDER 8
+#define STENCIL_WEIGHTS {-205.0 / 72.0, 8.0 / 5.0, -1.0 / 5.0, 8.0 / 315.0, -1.0 / 560.0}
+#include "p3D_acoustic_kernels.h"
+
+static const stencil_par stencils[] = {
+  {2, 1, stencil_weights_O2, explicit_box_O2, apply_box_O2},
+  {4, 2, stencil_weights_O4, explicit_box_O4, apply_box_O4},
+  {6, 3, stencil_weights_O6, explicit_box_O6, apply_box_O6},
+  {8, 4, stencil_weights_O8, explicit_box_O8, apply_box_O8}
+};
+
+
+
+
+
+
+/*
+  Main function
+*/
+int
+main(int argc, char * args[]) 
+{
+  /*
+    VARIABLES
+  */
+
+  struct stat st = {0};
+
+  // Create folders for output if they are missing
+  if (stat("./seism/", &st) == -1) 
+  {
+      mkdir("./seism/", 0700);
+  }
+
+  if (stat("./wavefields/", &st) == -1) 
+  {
+      mkdir("./wavefields/", 0700);
+  }
+
+  if (stat("./checkpoints/", &st) == -1) 
+  {
+      mkdir("./checkpoints/", 0700);
+  }
+
+  PetscErrorCode ierr;                              // PETSc error code
+  DM da;                                            // Mesh-object
+
+  // Initialize MPI first: with -shot_groups G the ranks are split into G groups before PETSc starts,
+  // and every group runs the whole program below on its own PETSC_COMM_WORLD
+  PetscMPIInt world_rank, world_size, ngroups = 1, group;
+  MPI_Comm group_comm;
+
+  PetscMPIInt thread_level;
+  MPI_Init_thread(&argc, &args, MPI_THREAD_FUNNELED, &thread_level);   // Only the master thread calls MPI
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  int a;
+  for (a = 1; a < argc - 1; a++)                    // The options database does not exist yet
+  {
+    if (!strcmp(args[a], "-shot_groups")) ngroups = atoi(args[a + 1]);
+  }
+  if ((ngroups < 1) || (ngroups > world_size)) ngroups = 1;
+
+  group = (PetscMPIInt) (((long) world_rank * ngroups) / world_size);
+  MPI_Comm_split(MPI_COMM_WORLD, group, world_rank, &group_comm);
+  PETSC_COMM_WORLD = group_comm;
+
+  // Initialize the PETSc database
+  ierr = PetscInitialize(&argc, &args, NULL, NULL);   CHKERRQ(ierr);
+  MPI_Comm comm = PETSC_COMM_WORLD;                 // The global PETSc MPI communicator, of this group
+  ierr = PetscOptionsHasName(NULL, NULL, "-shot_groups", NULL);   CHKERRQ(ierr);   // Read above, marked as used
+  ierr = PetscMemorySetGetMaximumUsage();   CHKERRQ(ierr);                         // High-water mark reported at the end
+
+
+  Vec b, u;
+  PetscScalar *pvel;
+  PetscScalar *pdx, *pdy, *pdz, *pxmax, *pymax, *pzmax;
+  PetscScalar *pt0, *pdt, *ptmax;
+  PetscInt *pnx, *pny, *pnz, *pnt;
+  PetscInt tmp;
+
+  ctx_t ctx, *pctx;                                 // User context structure
+
+  double total_time_begin = MPI_Wtime();            // Start total wall time counter
+
+  // Shot counter on world rank 0, taken with MPI_Fetch_and_op by the groups as they become free
+  ctx.queue.ngroups = ngroups;
+  ctx.queue.group = group;
+  ctx.queue.world = MPI_COMM_WORLD;
+  ctx.queue.counter = 0;
+  ctx.queue.done = 0;
+  ierr = MPI_Win_create(&ctx.queue.counter, (MPI_Aint) (world_rank ? 0 : sizeof(PetscMPIInt)), 
+                        sizeof(PetscMPIInt), MPI_INFO_NULL, MPI_COMM_WORLD, &ctx.queue.win);   CHKERRQ(ierr);
+
+  // PROFILING, stages and events reported by -log_view
+  PetscClassId classid;
+  ierr = PetscClassIdRegister("Acoustic", &classid);   CHKERRQ(ierr);
+  ierr = PetscLogStageRegister("Setup", &ctx.log.setup);   CHKERRQ(ierr);
+  ierr = PetscLogStageRegister("Time loop", &ctx.log.loop);   CHKERRQ(ierr);
+  ierr = PetscLogStageRegister("Output", &ctx.log.output);   CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("UpdateRHS", classid, &ctx.log.rhs);   CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("StepSolve", classid, &ctx.log.solve);   CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("ExplicitStep", classid, &ctx.log.leapfrog);   CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("Seismograms", classid, &ctx.log.seis);   CHKERRQ(ierr);
+  ierr = PetscLogEventRegister("Snapshot", classid, &ctx.log.snapshot);   CHKERRQ(ierr);
+  ierr = PetscLogStagePush(ctx.log.setup);   CHKERRQ(ierr);
+
+  // PER-STEP TABLE, -log_steps name writes shot, it, wall time, KSP iterations and residual of each step.
+  // With several shot groups every group writes name.<group>
+  char csv_name[PETSC_MAX_PATH_LEN], csv_file[PETSC_MAX_PATH_LEN + 8];
+  PetscBool csv_set;
+  ctx.log.csv = NULL;
+  ierr = PetscOptionsGetString(NULL, NULL, "-log_steps", csv_name, sizeof(csv_name), &csv_set); CHKERRQ(ierr);
+  if (csv_set)
+  {
+    if (ngroups > 1) snprintf(csv_file, sizeof(csv_file), "%s.%i", csv_name, group);
+    else             snprintf(csv_file, sizeof(csv_file), "%s", csv_name);
+    ierr = PetscFOpen(comm, csv_file, "w", &ctx.log.csv);   CHKERRQ(ierr);
+    ierr = PetscFPrintf(comm, ctx.log.csv, "shot,it,wall_time,ksp_its,residual_norm\n");   CHKERRQ(ierr);
+  }
+
+  // DISPLAY, a progress report every -display_every steps, with max, min and norm of u from one reduction
+  // unless -display_stats false. -display false keeps the cadence for the snapshots of -save_wavefield
+  ctx.log.display_every = 50;
+  ctx.log.display = PETSC_TRUE;
+  ctx.log.display_stats = PETSC_TRUE;
+  ctx.out.save = PETSC_FALSE;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-display_every", &ctx.log.display_every, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL, NULL, "-display", &ctx.log.display, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL, NULL, "-display_stats", &ctx.log.display_stats, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL, NULL, "-save_wavefield", &ctx.out.save, NULL); CHKERRQ(ierr);
+  if (ctx.log.display_every < 0)
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-display_every must not be negative");
+  }
+  ierr = MPI_Type_contiguous(3, MPIU_REAL, &ctx.log.stats_type);   CHKERRQ(ierr);
+  ierr = MPI_Type_commit(&ctx.log.stats_type);   CHKERRQ(ierr);
+  ierr = MPI_Op_create(stats_reduce, 1, &ctx.log.stats_op);   CHKERRQ(ierr);
+
+  // RUN SUMMARY, -summary_json name (default ./summary.json) written at exit, name.<group> with several groups
+  char summary_name[PETSC_MAX_PATH_LEN] = "./summary.json", summary_file[PETSC_MAX_PATH_LEN + 8];
+  ierr = PetscOptionsGetString(NULL, NULL, "-summary_json", summary_name, sizeof(summary_name), NULL); CHKERRQ(ierr);
+  if (ngroups > 1) snprintf(summary_file, sizeof(summary_file), "%s.%i", summary_name, group);
+  else             snprintf(summary_file, sizeof(summary_file), "%s", summary_name);
+
+
+  /*
+    LIST OF POINTERS
+  */
+  pctx = &ctx;
+  
+  pnx = &ctx.model.nx;
+  pny = &ctx.model.ny;
+  pnz = &ctx.model.nz;
+
+  pdx = &ctx.model.dx;
+  pdy = &ctx.model.dy;
+  pdz = &ctx.model.dz;
+  
+  pxmax = &ctx.model.xmax;
+  pymax = &ctx.model.ymax;
+  pzmax = &ctx.model.zmax;
+  
+  pvel = &ctx.model.vel;
+
+  pnt = &ctx.time.nt;
+  pt0 = &ctx.time.t0;
+  pdt = &ctx.time.dt;
+  ptmax = &ctx.time.tmax;
+
+  // SPATIAL ORDER, -order 2, 4 (default), 6 or 8
+  PetscInt order = 4;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-order", &order, NULL); CHKERRQ(ierr);
+  if ((order < 2) || (order > 2 * STENCIL_MAX_RADIUS) || (order % 2))
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-order must be 2, 4, 6 or 8");
+  }
+  ctx.stencil = stencils[order / 2 - 1];
+
+  /*
+    CREATE DMDA OBJECT. MESH
+  */
+  ierr = DMDACreate3d(comm, DM_BOUNDARY_GHOSTED, DM_BOUNDARY_NONE, DM_BOUNDARY_NONE,  // Create mesh
+                      DMDA_STENCIL_STAR, -32, -32, -32, PETSC_DECIDE, PETSC_DECIDE,
+                      PETSC_DECIDE, 1, ctx.stencil.radius, NULL, NULL, NULL, &da);   CHKERRQ(ierr);
+
+  ierr = DMDAGetInfo(da,0,pnx, pny, pnz, 0,0,0,0,0,0,0,0,0);  CHKERRQ(ierr);          // Get NX, NY, NZ
+
+  /*
+    CREATE GLOBAL VEC OBJECTS
+  */
+  ierr = DMCreateGlobalVector(da, &ctx.wf.level[0]);   CHKERRQ(ierr);   // Create a global u vector derived from the DM object
+  
+  ierr = VecDuplicate(ctx.wf.level[0], &b);   CHKERRQ(ierr);          // RHS of the system
+
+  // MIXED PRECISION, -history_float keeps T-1, T-2 and T-3 as float arrays. The solve, its reductions 
+  // and the RHS accumulation stay in double, on the single Vec every slot of the ring refers to
+  ctx.wf.single = PETSC_FALSE;
+  ctx.wf.hist[0] = ctx.wf.hist[1] = ctx.wf.hist[2] = ctx.wf.hist[3] = NULL;
+  ierr = PetscOptionsGetBool(NULL, NULL, "-history_float", &ctx.wf.single, NULL); CHKERRQ(ierr);
+  if (ctx.wf.single)
+  {
+    PetscInt nloc;
+    ierr = VecGetLocalSize(ctx.wf.level[0], &nloc);   CHKERRQ(ierr);
+    ierr = PetscMalloc4(nloc, &ctx.wf.hist[0], nloc, &ctx.wf.hist[1], 
+                        nloc, &ctx.wf.hist[2], nloc, &ctx.wf.hist[3]);   CHKERRQ(ierr);
+    ierr = PetscObjectReference((PetscObject) ctx.wf.level[0]);   CHKERRQ(ierr);   // Destroyed once per slot
+    ierr = PetscObjectReference((PetscObject) ctx.wf.level[0]);   CHKERRQ(ierr);
+    ierr = PetscObjectReference((PetscObject) ctx.wf.level[0]);   CHKERRQ(ierr);
+    ctx.wf.level[1] = ctx.wf.level[2] = ctx.wf.level[3] = ctx.wf.level[0];
+  }
+  else
+  {
+    ierr = VecDuplicate(ctx.wf.level[0], &ctx.wf.level[1]); CHKERRQ(ierr);   // Remaining time levels of the ring
+    ierr = VecDuplicate(ctx.wf.level[0], &ctx.wf.level[2]); CHKERRQ(ierr);
+    ierr = VecDuplicate(ctx.wf.level[0], &ctx.wf.level[3]); CHKERRQ(ierr);
+  }
+
+  // DEVICE PATH, -dm_vec_type of a GPU backend gives device Vecs, see device_par
+  PetscBool host_vec;
+  ierr = PetscObjectTypeCompareAny((PetscObject) ctx.wf.level[0], &host_vec, VECSEQ, VECMPI, "");   CHKERRQ(ierr);
+  ctx.dev.on = (PetscBool) !host_vec;
+
+  ierr = first_touch(da, b);   CHKERRQ(ierr);                          // Arrays the kernels stream through
+  ierr = first_touch(da, ctx.wf.level[0]);   CHKERRQ(ierr);
+  if (!ctx.wf.single)
+  {
+    ierr = first_touch(da, ctx.wf.level[1]);   CHKERRQ(ierr);
+    ierr = first_touch(da, ctx.wf.level[2]);   CHKERRQ(ierr);
+    ierr = first_touch(da, ctx.wf.level[3]);   CHKERRQ(ierr);
+  }
+
+  /*
+    SET MODEL PATRAMETERS
+  */
+  // Wave propagation VELOCITY
+  *pvel = 3.5f;
+  ierr = PetscOptionsGetReal(NULL, NULL, "-vel",&ctx.model.vel, NULL); CHKERRQ(ierr);   //input on-the-fly
+
+  // HETEROGENEOUS VELOCITY, -vel_file holds a Vec on the [NZ][NY][NX] grid in PETSc binary
+  char vel_file[PETSC_MAX_PATH_LEN];
+  PetscBool vel_file_set;
+  ctx.model.vel2 = NULL;
+  ierr = PetscOptionsGetString(NULL, NULL, "-vel_file", vel_file, sizeof(vel_file), &vel_file_set); CHKERRQ(ierr);
+  if (vel_file_set)
+  {
+    PetscViewer viewer;
+    ierr = DMCreateGlobalVector(da, &ctx.model.vel2);   CHKERRQ(ierr);
+    ierr = first_touch(da, ctx.model.vel2);   CHKERRQ(ierr);
+    ierr = PetscViewerBinaryOpen(comm, vel_file, FILE_MODE_READ, &viewer);   CHKERRQ(ierr);
+    ierr = VecLoad(ctx.model.vel2, viewer);   CHKERRQ(ierr);                // Parallel read, natural ordering
+    ierr = PetscViewerDestroy(&viewer);   CHKERRQ(ierr);
+  }
+  
+  // MODEL SIZE Xmax Ymax Zmax in meters
+  *pxmax = 8.f;                     //[km]
+  *pymax = 8.f;
+  *pzmax = 8.f;
+  ierr = PetscOptionsGetReal(NULL, NULL, "-xmax",&ctx.model.xmax, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetReal(NULL, NULL, "-ymax",&ctx.model.ymax, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetReal(NULL, NULL, "-zmax",&ctx.model.zmax, NULL); CHKERRQ(ierr);
+
+  // GRID STEP DX DY and DZ
+  *pdx = *pxmax / *pnx;             //[km]
+  *pdy = *pymax / *pny;
+  *pdz = *pzmax / *pnz;
+
+  PetscScalar cmax, cmin, lambda_min;
+
+  cmin = *pvel;
+  cmax = *pvel;
+  if (ctx.model.vel2)
+  {
+    ierr = VecMin(ctx.model.vel2, NULL, &cmin);   CHKERRQ(ierr);
+    ierr = VecMax(ctx.model.vel2, NULL, &cmax);   CHKERRQ(ierr);
+    if (cmin <= 0.f)
+    {
+      SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-vel_file must hold positive velocities");
+    }
+    // Only the squares are needed from now on, the kernels scale each row by them
+    ierr = VecPointwiseMult(ctx.model.vel2, ctx.model.vel2, ctx.model.vel2);   CHKERRQ(ierr);
+  }
+
+  // ABSORBING LAYER, -abc_width grid points of Cerjan sponge inside each face of the model
+  ctx.abc.width = 0;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-abc_width", &ctx.abc.width, NULL); CHKERRQ(ierr);
+  ierr = build_sponge(pctx);   CHKERRQ(ierr);
+
+  // TIME STEPPING SCHEME, -scheme implicit (default) or -scheme explicit
+  char scheme_type[16] = "implicit";
+  ierr = PetscOptionsGetString(NULL, NULL, "-scheme", scheme_type, sizeof(scheme_type), NULL); CHKERRQ(ierr);
+  ierr = PetscStrcmp(scheme_type, "explicit", &ctx.solver.explicit_scheme); CHKERRQ(ierr);
+  if (ctx.wf.single && (ctx.solver.explicit_scheme || ctx.dev.on))
+  {
+    SETERRQ(comm, PETSC_ERR_SUP, "-history_float needs the implicit scheme on host Vecs");
+  }
+
+  // ACTIVE REGION, -active_region: the explicit step sweeps only the box around the source that the wave
+  // can have reached, cmax * t / h plus -active_margin nodes along each axis
+  ctx.active.on = PETSC_FALSE;
+  ctx.active.margin = 2 * ctx.stencil.radius;
+  ctx.active.cmax = cmax;
+  ctx.active.updated = 0.f;
+  ctx.active.full = 0.f;
+  ierr = PetscOptionsGetBool(NULL, NULL, "-active_region", &ctx.active.on, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-active_margin", &ctx.active.margin, NULL); CHKERRQ(ierr);
+  ierr = DMDAGetInfo(da, 0, &ctx.active.n[0], &ctx.active.n[1], &ctx.active.n[2], 0,0,0,0,0,0,0,0,0);   CHKERRQ(ierr);
+  if (ctx.active.on && !ctx.solver.explicit_scheme)
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"WARNING: the implicit solve couples every node at every step, "
+                "-active_region applies to -scheme explicit only\n\n");
+    ctx.active.on = PETSC_FALSE;
+  }
+  if (ctx.active.margin < 0)
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-active_margin must not be negative");
+  }
+
+  // TIME STEPPING PARAMETERS. The explicit scheme is stable for c*dt*sqrt(1/dx2 + 1/dy2 + 1/dz2) <= 2 / sqrt(s),
+  // s = |d[0] + 2 sum_m (-1)^m d[m]| the largest eigenvalue of the 1D stencil: 4 for O(2,2), 16/3 for O(2,4),
+  // so the bound 2 / sqrt(s) is 1 and 0.866
+  PetscScalar s_max = ctx.stencil.d[0];
+  PetscInt m;
+  for (m = 1; m <= ctx.stencil.radius; m++)
+  {
+    s_max += 2.f * ((m % 2) ? -1.f : 1.f) * ctx.stencil.d[m];
+  }
+  ctx.time.dt_stable = 2.f / sqrt(PetscAbsScalar(s_max)) / 
+                       (cmax * sqrt(1.f / pow(*pdx, 2) + 1.f / pow(*pdy, 2) + 1.f / pow(*pdz, 2)));
+
+  PetscScalar dt_implicit, dt_explicit;
+  PetscBool dt_set;
+
+  dt_implicit = (*pdx) / cmax;      //[sec], to have CFL = 1
+  dt_explicit = 0.9f * ctx.time.dt_stable;
+
+  *pdt = ctx.solver.explicit_scheme ? dt_explicit : dt_implicit;    // could be set from runtime
+  ierr = PetscOptionsGetReal(NULL, NULL, "-dt",&ctx.time.dt, &dt_set); CHKERRQ(ierr);
+  if (dt_set && ctx.solver.explicit_scheme) dt_explicit = *pdt;
+  if (dt_set && !ctx.solver.explicit_scheme) dt_implicit = *pdt;
+
+  *ptmax = 1.f;                     //[sec]
+  ierr = PetscOptionsGetReal(NULL, NULL, "-tmax",&ctx.time.tmax, NULL); CHKERRQ(ierr);
+  
+  *pnt = *ptmax / *pdt;
+  ctx.time.it0 = 0;
+  ctx.time.steps = 0;
+
+  // SOURCE PARAMETERS, -nshots sources on a line along X, -isrc is the first one and -shot_di the spacing
+  PetscInt isrc, jsrc, ksrc, shot_di, s;
+  PetscScalar f0;
+
+  ctx.nshots = 1;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-nshots",&ctx.nshots, NULL); CHKERRQ(ierr);
+  if (ctx.nshots < 1)
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-nshots must be positive");
+  }
+
+  isrc = (PetscInt) *pnx / (ctx.nshots + 1);      // NX / 2 for a single shot
+  jsrc = (PetscInt) *pny / 2;
+  ksrc = (PetscInt) *pnz / 2;
+  shot_di = (PetscInt) *pnx / (ctx.nshots + 1);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-isrc",&isrc, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-jsrc",&jsrc, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-ksrc",&ksrc, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-shot_di",&shot_di, NULL); CHKERRQ(ierr);
+  
+  f0 = 20.f;                        //[Hz]
+  ierr = PetscOptionsGetReal(NULL, NULL, "-f0",&f0, NULL); CHKERRQ(ierr);
+
+  ierr = PetscMalloc1(ctx.nshots, &ctx.src);   CHKERRQ(ierr);
+  for (s = 0; s < ctx.nshots; s++)
+  {
+    ctx.src[s].isrc = isrc + s * shot_di;
+    ctx.src[s].jsrc = jsrc;
+    ctx.src[s].ksrc = ksrc;
+    if ((ctx.src[s].isrc < 1) || (ctx.src[s].isrc > *pnx - 2))
+    {
+      SETERRQ1(comm, PETSC_ERR_ARG_OUTOFRANGE, "Shot %i falls outside of the model, check -isrc and -shot_di", s);
+    }
+    if ((ctx.src[s].jsrc < 1) || (ctx.src[s].jsrc > *pny - 2))
+    {
+      SETERRQ1(comm, PETSC_ERR_ARG_OUTOFRANGE, "Shot %i falls outside of the model, check -jsrc", s);
+    }
+    if ((ctx.src[s].ksrc < 1) || (ctx.src[s].ksrc > *pnz - 2))
+    {
+      SETERRQ1(comm, PETSC_ERR_ARG_OUTOFRANGE, "Shot %i falls outside of the model, check -ksrc", s);
+    }
+
+    ctx.src[s].f0 = f0;
+    ctx.src[s].factor = pow(10.f,7);     //amplitude
+    ctx.src[s].angle_force = 90;         // degrees
+  }
+  ctx.shot = 0;
+
+  // POINT SOURCES OF A SHOT, one node by default, -src_line n nodes along Y every -src_dj centered on it,
+  // or -src_file with one "di dj dk weight" line per node, offsets from the shot position
+  char src_file[PETSC_MAX_PATH_LEN];
+  PetscBool src_file_set;
+  PetscInt src_line = 1, src_dj = 1, p;
+  PetscScalar *table = NULL;
+  ierr = PetscOptionsGetString(NULL, NULL, "-src_file", src_file, sizeof(src_file), &src_file_set); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-src_line", &src_line, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-src_dj", &src_dj, NULL); CHKERRQ(ierr);
+  if (src_file_set && (src_line > 1))
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_INCOMP, "-src_file and -src_line are exclusive");
+  }
+  if (src_line < 1)
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-src_line must be positive");
+  }
+  ctx.srcs.npts = src_line;
+  if (src_file_set)
+  {
+    ierr = read_text_table(src_file, 4, &ctx.srcs.npts, &table);   CHKERRQ(ierr);
+    if (ctx.srcs.npts < 1)
+    {
+      SETERRQ(comm, PETSC_ERR_FILE_UNEXPECTED, "-src_file holds no source");
+    }
+  }
+  ierr = PetscMalloc4(ctx.srcs.npts, &ctx.srcs.di, ctx.srcs.npts, &ctx.srcs.dj, ctx.srcs.npts, &ctx.srcs.dk, 
+                      ctx.srcs.npts, &ctx.srcs.w);   CHKERRQ(ierr);
+  for (p = 0; p < ctx.srcs.npts; p++)
+  {
+    ctx.srcs.di[p] = table ? (PetscInt) table[4 * p] : 0;
+    ctx.srcs.dj[p] = table ? (PetscInt) table[4 * p + 1] : (p - (src_line - 1) / 2) * src_dj;
+    ctx.srcs.dk[p] = table ? (PetscInt) table[4 * p + 2] : 0;
+    ctx.srcs.w[p] = table ? table[4 * p + 3] : 1.f;
+  }
+  ierr = PetscFree(table);   CHKERRQ(ierr);
+  ierr = PetscMalloc2(ctx.srcs.npts, &ctx.srcs.loc, ctx.srcs.npts, &ctx.srcs.wloc);   CHKERRQ(ierr);
+  ctx.srcs.nloc = 0;
+
+  // SOURCE TIME FUNCTION, the Ricker wavelet of -f0 or the samples of -wavelet_file taken every -wavelet_dt,
+  // interpolated to the steps once and zero after the last sample
+  char wavelet_file[PETSC_MAX_PATH_LEN];
+  PetscBool wavelet_file_set;
+  ctx.srcs.nfile = 0;
+  ctx.srcs.file = NULL;
+  ctx.srcs.file_dt = *pdt;
+  ierr = PetscOptionsGetString(NULL, NULL, "-wavelet_file", wavelet_file, sizeof(wavelet_file), &wavelet_file_set); CHKERRQ(ierr);
+  ierr = PetscOptionsGetReal(NULL, NULL, "-wavelet_dt", &ctx.srcs.file_dt, NULL); CHKERRQ(ierr);
+  if (wavelet_file_set)
+  {
+    ierr = read_text_table(wavelet_file, 1, &ctx.srcs.nfile, &ctx.srcs.file);   CHKERRQ(ierr);
+    if ((ctx.srcs.nfile < 1) || (ctx.srcs.file_dt <= 0.f))
+    {
+      SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-wavelet_file needs samples and a positive -wavelet_dt");
+    }
+  }
+  ierr = PetscMalloc1(*pnt + 1, &ctx.srcs.wavelet);   CHKERRQ(ierr);
+  ierr = wavelet_table(pctx);   CHKERRQ(ierr);
+
+  lambda_min = cmin / f0;           // Min wavelength in model
+
+  // RECEIVERS
+  ctx.rec.nrec = 20;                // Number of receivers
+  ierr = PetscOptionsGetInt(NULL, NULL, "-nrec",&ctx.rec.nrec, NULL); CHKERRQ(ierr);
+
+
+  PetscInt irec[ctx.rec.nrec], *pirec; // Arrays for rec positions
+  PetscInt jrec[ctx.rec.nrec], *pjrec;
+  PetscInt krec[ctx.rec.nrec], *pkrec;
+
+  pirec = &irec[0];
+  pjrec = &jrec[0];
+  pkrec = &krec[0];
+
+  // Place receivers on diogonal
+  int i;
+  for (i = 0; i < ctx.rec.nrec; i++)
+  {
+    *(pirec + i) = (PetscInt) (ctx.rec.nrec - i) * (ctx.model.nx) / ctx.rec.nrec;
+    *(pjrec + i) = (PetscInt) (ctx.rec.nrec - i) * (ctx.model.ny) / ctx.rec.nrec;
+    *(pkrec + i) = (PetscInt) (ctx.rec.nrec - i) * (ctx.model.nz) / ctx.rec.nrec;
+  }
+  
+  ctx.rec.irec = irec;
+  ctx.rec.jrec = jrec;
+  ctx.rec.krec = krec;
+
+  // SEISMOGRAM OUTPUT, -seis_format binary streams chunks of -seis_chunk steps into one file
+  const char *seis_formats[] = {"txt", "binary"};
+  PetscInt seis_format_id = SEIS_TXT;
+  PetscInt seis_chunk = 100;
+  ierr = PetscOptionsGetEList(NULL, NULL, "-seis_format", seis_formats, 2, &seis_format_id, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-seis_chunk", &seis_chunk, NULL); CHKERRQ(ierr);
+  ctx.rec.format = (seismogram_format) seis_format_id;
+  if (seis_chunk < 1)
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-seis_chunk must be positive");
+  }
+  ctx.rec.nbuf = (ctx.rec.format == SEIS_BINARY) ? PetscMin(seis_chunk, *pnt) : *pnt;
+
+  // ACCURACY CHECK, -check_accuracy compares the traces with the analytic solution of a homogeneous medium
+  ctx.rec.check = PETSC_FALSE;
+  ierr = PetscOptionsGetBool(NULL, NULL, "-check_accuracy", &ctx.rec.check, NULL); CHKERRQ(ierr);
+  if (ctx.rec.check && ctx.model.vel2)
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"WARNING: -check_accuracy needs a homogeneous model, it is ignored with -vel_file\n\n");
+    ctx.rec.check = PETSC_FALSE;
+  }
+  if (ctx.rec.check && ((ctx.srcs.npts > 1) || ctx.srcs.nfile))
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"WARNING: -check_accuracy needs a single Ricker point source, it is ignored "
+                "with -src_file, -src_line and -wavelet_file\n\n");
+    ctx.rec.check = PETSC_FALSE;
+  }
+
+  // Each rank only stores the traces of the receivers it owns
+  ierr = locate_receivers(da, pctx);   CHKERRQ(ierr);
+  if (ctx.dev.on)
+  {
+    ierr = device_setup(da, pctx);   CHKERRQ(ierr);
+  }
+
+
+  // OUTPUT
+  PetscPrintf(PETSC_COMM_WORLD,"MODEL:\n");
+  PetscPrintf(PETSC_COMM_WORLD,"\t XMAX %f \t DX %f km \t NX %i\n", *pxmax, *pdx, *pnx);
+  PetscPrintf(PETSC_COMM_WORLD,"\t YMAX %f \t DY %f km \t NY %i\n", *pymax, *pdy, *pny);
+  PetscPrintf(PETSC_COMM_WORLD,"\t ZMAX %f \t DZ %f km \t NZ %i\n", *pzmax, *pdz, *pnz);
+  PetscPrintf(PETSC_COMM_WORLD,"\t MAX C \t %f km/s \n", cmax);
+  PetscPrintf(PETSC_COMM_WORLD,"\t MIN C \t %f km/s \n", cmin);
+  PetscPrintf(PETSC_COMM_WORLD,"\n");
+
+  PetscPrintf(PETSC_COMM_WORLD,"SOURCE:\n");
+  for (s = 0; s < ctx.nshots; s++)
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"\t ISRC %i \t JSRC %i \t KSRC %i\n", ctx.src[s].isrc, ctx.src[s].jsrc, ctx.src[s].ksrc);
+  }
+  PetscPrintf(PETSC_COMM_WORLD,"\t POINTS PER SHOT \t %i \n", ctx.srcs.npts);
+  if (ctx.srcs.nfile)
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"\t WAVELET \t %i samples every %g s from %s \n", ctx.srcs.nfile, ctx.srcs.file_dt, wavelet_file);
+  }
+  PetscPrintf(PETSC_COMM_WORLD,"\t F0 \t %f Hz \n", f0);
+  PetscPrintf(PETSC_COMM_WORLD,"\t MIN Lambda \t %f km \n", lambda_min);
+  PetscPrintf(PETSC_COMM_WORLD,"\t POINTS PER WAvelENGTH \t %f \n", lambda_min/(*pdx));
+  PetscPrintf(PETSC_COMM_WORLD,"\n");
+
+  PetscPrintf(PETSC_COMM_WORLD,"RECEIVERS:\n");
+  PetscPrintf(PETSC_COMM_WORLD,"\t NREC \t %i\n", ctx.rec.nrec);
+  PetscPrintf(PETSC_COMM_WORLD,"\t IREC \t JREC \t KSREC \n");
+
+  // PRINT RECEIVER POSITIONS'
+  int rr;
+  for (rr = 0; rr < ctx.rec.nrec; rr++)
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"\t %i \t %i \t %i \n", ctx.rec.irec[rr], ctx.rec.jrec[rr], ctx.rec.krec[rr]);
+  }
+
+  PetscPrintf(PETSC_COMM_WORLD,"\n");
+
+  PetscPrintf(PETSC_COMM_WORLD,"TIME STEPPING: \n");
+  PetscPrintf(PETSC_COMM_WORLD,"\t TMAX %f \t DT %f \t NT %i\n", *ptmax, *pdt, *pnt);
+  PetscPrintf(PETSC_COMM_WORLD,"\n");
+
+  PetscPrintf(PETSC_COMM_WORLD,"CFL CONDITION: \t %f \n", cmax * (*pdt)/(*pdx));
+  PetscPrintf(PETSC_COMM_WORLD,"\n");
+
+  PetscPrintf(PETSC_COMM_WORLD,"SCHEME: \t %s \t O(2,%i) \n", ctx.solver.explicit_scheme ? "explicit" : "implicit", 
+              ctx.stencil.order);
+  PetscPrintf(PETSC_COMM_WORLD,"\t STABLE EXPLICIT DT \t %f \n", ctx.time.dt_stable);
+  if (ctx.solver.explicit_scheme && (*pdt > ctx.time.dt_stable))
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"\t WARNING: DT exceeds the stability limit of the explicit scheme \n");
+  }
+  PetscPrintf(PETSC_COMM_WORLD,"\n");
+  
+  VecGetSize(ctx.wf.level[0], &tmp);
+  PetscPrintf(PETSC_COMM_WORLD,"MATRICES AND VECTORS: \n");
+  PetscPrintf(PETSC_COMM_WORLD,"\t Vec elements \t %i\n", tmp);
+  PetscPrintf(PETSC_COMM_WORLD,"\t Vec data \t %s\n", ctx.dev.on ? "device" : "host");
+  PetscPrintf(PETSC_COMM_WORLD,"\t History levels \t %s\n", ctx.wf.single ? "float" : "double");
+#if defined(_OPENMP)
+  PetscPrintf(PETSC_COMM_WORLD,"\t OpenMP threads per rank \t %i\n", omp_get_max_threads());
+#endif
+  PetscPrintf(PETSC_COMM_WORLD,"\t Mat \t %i x %i x %i \n", *pnx, *pny, *pnz);
+  PetscPrintf(PETSC_COMM_WORLD,"\n");
+
+
+
+  // SNAPSHOT FORMAT, -snapshot_format ascii (default), binary, hdf5 or compressed with -snapshot_tolerance
+  const char *snapshot_formats[] = {"ascii", "binary", "hdf5", "compressed"};
+  PetscInt snapshot_format_id = SNAPSHOT_ASCII;
+  ierr = PetscOptionsGetEList(NULL, NULL, "-snapshot_format", snapshot_formats, 4, &snapshot_format_id, NULL); CHKERRQ(ierr);
+  ctx.out.format = (snapshot_format) snapshot_format_id;
+  ctx.out.tolerance = 1e-3;
+  ierr = PetscOptionsGetReal(NULL, NULL, "-snapshot_tolerance", &ctx.out.tolerance, NULL); CHKERRQ(ierr);
+  if (ctx.out.tolerance <= 0.f)
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-snapshot_tolerance must be positive");
+  }
+
+  // SUB-VOLUME, -snapshot_slice x|y|z:index and/or -snapshot_stride n, only that part of the grid is written
+  char slice[32];
+  PetscBool slice_set;
+  ctx.out.stride = 1;
+  ctx.out.slice_axis = -1;
+  ctx.out.slice_index = 0;
+  ctx.out.sub = NULL;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-snapshot_stride", &ctx.out.stride, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetString(NULL, NULL, "-snapshot_slice", slice, sizeof(slice), &slice_set); CHKERRQ(ierr);
+  if (slice_set)
+  {
+    char axis = 0;
+    int index = -1;
+    if ((sscanf(slice, "%c:%d", &axis, &index) != 2) || (axis < 'x') || (axis > 'z'))
+    {
+      SETERRQ(comm, PETSC_ERR_ARG_WRONG, "-snapshot_slice must be x:index, y:index or z:index");
+    }
+    ctx.out.slice_axis = axis - 'x';
+    ctx.out.slice_index = index;
+  }
+  if ((ctx.out.stride > 1) || slice_set)
+  {
+    ierr = snapshot_subset_setup(da, pctx);   CHKERRQ(ierr);
+    if (ctx.out.format == SNAPSHOT_COMPRESSED)
+    {
+      PetscPrintf(PETSC_COMM_WORLD,"WARNING: -snapshot_format compressed needs the full grid, the sub-volume is written as binary\n\n");
+      ctx.out.format = SNAPSHOT_BINARY;
+    }
+  }
+
+  // ASYNCHRONOUS SNAPSHOTS, -snapshot_async with -snapshot_buffers staging buffers in the pool
+  ctx.out.async = PETSC_FALSE;
+  ctx.out.nslots = 2;
+  ctx.out.next = 0;
+  ctx.out.slots = NULL;
+  ierr = PetscOptionsGetBool(NULL, NULL, "-snapshot_async", &ctx.out.async, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-snapshot_buffers", &ctx.out.nslots, NULL); CHKERRQ(ierr);
+  if (ctx.out.async && (ctx.out.format != SNAPSHOT_BINARY))
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"WARNING: -snapshot_async needs -snapshot_format binary, snapshots are written synchronously\n\n");
+    ctx.out.async = PETSC_FALSE;
+  }
+  if (ctx.out.async && ctx.out.sub)
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"WARNING: -snapshot_async writes the full grid, sub-volumes are written synchronously\n\n");
+    ctx.out.async = PETSC_FALSE;
+  }
+  if (ctx.out.async)
+  {
+    PetscInt nloc, s;
+    if (ctx.out.nslots < 1)
+    {
+      SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-snapshot_buffers must be positive");
+    }
+    ierr = VecGetLocalSize(ctx.wf.level[0], &nloc);   CHKERRQ(ierr);
+    ierr = PetscMalloc1(ctx.out.nslots, &ctx.out.slots);   CHKERRQ(ierr);
+    for (s = 0; s < ctx.out.nslots; s++)
+    {
+      ierr = PetscMalloc1(nloc, &ctx.out.slots[s].buf);   CHKERRQ(ierr);
+      ctx.out.slots[s].busy = PETSC_FALSE;
+    }
+  }
+
+  // OPERATOR TYPE, -operator aij (assembled, default) or -operator shell (matrix-free)
+  char operator_type[16] = "aij";
+  ierr = PetscOptionsGetString(NULL, NULL, "-operator", operator_type, sizeof(operator_type), NULL); CHKERRQ(ierr);
+  ierr = PetscStrcmp(operator_type, "shell", &ctx.solver.matfree); CHKERRQ(ierr);
+  ctx.solver.da = da;
+  if (ctx.dev.on && (ctx.solver.explicit_scheme || ctx.solver.matfree))
+  {
+    PetscPrintf(PETSC_COMM_WORLD,"WARNING: the explicit scheme and -operator shell apply the stencil on host arrays, "
+                "the wavefield is copied to the host at every step. Use the assembled operator with a device "
+                "-dm_mat_type\n\n");
+  }
+
+  // NULL SPACE. Dirichlet rows make A nonsingular, -nullspace keeps the constant one 
+  // removed from b. It is built here once, attached to A and applied by KSPSolve
+  PetscBool use_nullspace = PETSC_FALSE;
+  ierr = PetscOptionsGetBool(NULL, NULL, "-nullspace", &use_nullspace, NULL); CHKERRQ(ierr);
+  ctx.solver.nullspace = NULL;
+  if (use_nullspace)
+  {
+    ierr = MatNullSpaceCreate(comm, PETSC_TRUE, 0, NULL, &ctx.solver.nullspace);   CHKERRQ(ierr);
+  }
+
+  /*  
+    CREATE KSP, KRYLOV SUBSPACE OBJECTS 
+  */
+  KSP ksp_u;
+  Mat A = NULL;
+
+  // Create Krylov solver for u component
+  ierr = KSPCreate(comm, &ksp_u);   CHKERRQ(ierr);                       // Create the KPS object
+  ierr = KSPSetDM(ksp_u, (DM) da);   CHKERRQ(ierr);                      // Set the DM to be used as preconditioner
+
+  if (ctx.solver.matfree)
+  {
+    PC pc_u;
+    PetscInt nloc;
+
+    // Shell matrix with the same parallel layout as the DMDA global vectors
+    ierr = VecGetLocalSize(ctx.wf.level[0], &nloc);   CHKERRQ(ierr);
+    ierr = MatCreateShell(comm, nloc, nloc, tmp, tmp, &ctx, &A);   CHKERRQ(ierr);
+    ierr = MatShellSetOperation(A, MATOP_MULT, (void (*)(void)) apply_A_u);   CHKERRQ(ierr);
+    ierr = MatShellSetOperation(A, MATOP_GET_DIAGONAL, (void (*)(void)) diag_A_u);   CHKERRQ(ierr);
+    if (ctx.solver.nullspace)
+    {
+      ierr = MatSetNullSpace(A, ctx.solver.nullspace);   CHKERRQ(ierr);
+      ierr = MatSetTransposeNullSpace(A, ctx.solver.nullspace);   CHKERRQ(ierr);   // KSPSolve removes it from b
+    }
+
+    ierr = KSPSetOperators(ksp_u, A, A);   CHKERRQ(ierr);                // Nothing is assembled
+    ierr = KSPSetDMActive(ksp_u, PETSC_FALSE);   CHKERRQ(ierr);          // RHS is built explicitly in the time loop
+
+    ierr = KSPGetPC(ksp_u, &pc_u);   CHKERRQ(ierr);
+    ierr = PCSetType(pc_u, PCJACOBI);   CHKERRQ(ierr);                   // Only the diagonal is available, -pc_type still overrides
+  }
+  else
+  {
+    ierr = KSPSetComputeOperators(ksp_u, compute_A_u, &ctx);   CHKERRQ(ierr);   // Compute and assemble the coefficient matrix A
+  }
+  // A does not change in time, so by default the preconditioner is set up only once. 
+  // The initial guess is extrapolated from the history levels, -guess_order 0..3
+  ctx.solver.guess_order = 2;
+  ctx.solver.log_its = PETSC_FALSE;
+  ctx.solver.its = 0;
+  ctx.solver.its_total = 0;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-guess_order", &ctx.solver.guess_order, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL, NULL, "-log_its", &ctx.solver.log_its, NULL); CHKERRQ(ierr);
+  if ((ctx.solver.guess_order < 0) || (ctx.solver.guess_order > 3))
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-guess_order must be 0, 1, 2 or 3");
+  }
+
+  ierr = KSPSetReusePreconditioner(ksp_u, PETSC_TRUE);   CHKERRQ(ierr);           // -ksp_reuse_preconditioner 0 overrides
+  ierr = KSPSetInitialGuessNonzero(ksp_u, (PetscBool) (ctx.solver.guess_order > 0));   CHKERRQ(ierr);
+  ierr = KSPSetFromOptions(ksp_u);   CHKERRQ(ierr);                      // KSP options can be changed during the runtime
+
+  if (ctx.solver.matfree)
+  {
+    PC pc_u;
+    PetscBool is_mg;
+
+    // PCMG builds its levels from the DMDA through compute_A_u, which the shell operator bypasses
+    ierr = KSPGetPC(ksp_u, &pc_u);   CHKERRQ(ierr);
+    ierr = PetscObjectTypeCompare((PetscObject) pc_u, PCMG, &is_mg);   CHKERRQ(ierr);
+    if (is_mg)
+    {
+      SETERRQ(comm, PETSC_ERR_SUP, "-pc_type mg needs the assembled operator, use -operator aij");
+    }
+  }
+
+  // CHECKPOINTS every -checkpoint_every steps, -restart resumes the shot of the latest one of this group
+  PetscBool restart = PETSC_FALSE;
+  PetscViewer resume = NULL;
+  ctx.ckpt.every = 0;
+  ctx.ckpt.keep = 2;
+  ctx.ckpt.count = 0;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-checkpoint_every", &ctx.ckpt.every, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-checkpoint_keep", &ctx.ckpt.keep, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL, NULL, "-restart", &restart, NULL); CHKERRQ(ierr);
+  if ((ctx.ckpt.every < 0) || (ctx.ckpt.keep < 1))
+  {
+    SETERRQ(comm, PETSC_ERR_ARG_OUTOFRANGE, "-checkpoint_every must not be negative and -checkpoint_keep must be positive");
+  }
+  if (restart)
+  {
+    ierr = checkpoint_open(pctx, &resume);   CHKERRQ(ierr);
+  }
+
+  // The shot counter resumes after the newest shot any group was running, the ones before were all done
+  if (restart)
+  {
+    PetscMPIInt taken = resume ? (PetscMPIInt) ctx.shot + 1 : 0, first;
+    ierr = MPI_Allreduce(&taken, &first, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);   CHKERRQ(ierr);
+    if (!world_rank)
+    {
+      ierr = MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, ctx.queue.win);   CHKERRQ(ierr);
+      ctx.queue.counter = first;
+      ierr = MPI_Win_unlock(0, ctx.queue.win);   CHKERRQ(ierr);
+    }
+    ierr = MPI_Barrier(MPI_COMM_WORLD);   CHKERRQ(ierr);
+  }
+
+  // REVERSE REPLAY, -rtm with -rtm_snaps states in memory, -rtm_memory MB per rank or log2(nt) of them by default
+  PetscReal rtm_memory = 0.f;
+  ctx.rtm.on = PETSC_FALSE;
+  ctx.rtm.verify = PETSC_FALSE;
+  ctx.rtm.norm = NULL;
+  ctx.rtm.nslots = (PetscInt) ceil(log2(PetscMax(*pnt, 2)));
+  ierr = PetscOptionsGetBool(NULL, NULL, "-rtm", &ctx.rtm.on, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetBool(NULL, NULL, "-rtm_verify", &ctx.rtm.verify, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetReal(NULL, NULL, "-rtm_memory", &rtm_memory, NULL); CHKERRQ(ierr);
+  ierr = PetscOptionsGetInt(NULL, NULL, "-rtm_snaps", &ctx.rtm.nslots, NULL); CHKERRQ(ierr);
+  if (ctx.rtm.on && ctx.wf.single)
+  {
+    SETERRQ(comm, PETSC_ERR_SUP, "-rtm keeps the replayed states as Vecs, which -history_float does not use");
+  }
+  if (ctx.rtm.on)
+  {
+    PetscInt nloc, fit, fit_min;
+    ierr = VecGetLocalSize(ctx.wf.level[0], &nloc);   CHKERRQ(ierr);
+    if (rtm_memory > 0.f)
+    {
+      fit = (PetscInt) (rtm_memory * 1048576.f / (3 * nloc * sizeof(PetscScalar)));
+      ierr = MPI_Allreduce(&fit, &fit_min, 1, MPIU_INT, MPI_MIN, comm);   CHKERRQ(ierr);
+      ctx.rtm.nslots = fit_min;
+    }
+    ctx.rtm.nslots = PetscMax(PetscMin(ctx.rtm.nslots, *pnt - 1), 0);
+    if (!ctx.rtm.nslots)
+    {
+      PetscPrintf(PETSC_COMM_WORLD,"WARNING: -rtm has no memory for a state, the replay recomputes O(NT^2) steps\n\n");
+    }
+    ctx.rtm.slot = NULL;
+    if (ctx.rtm.nslots)
+    {
+      ierr = VecDuplicateVecs(ctx.wf.level[0], 3 * ctx.rtm.nslots, &ctx.rtm.slot);   CHKERRQ(ierr);
+    }
+    ierr = VecDuplicate(ctx.wf.level[0], &ctx.rtm.illum);   CHKERRQ(ierr);
+    if (ctx.rtm.verify)
+    {
+      ierr = PetscMalloc1(*pnt, &ctx.rtm.norm);   CHKERRQ(ierr);       // One more reduction per forward step
+    }
+  }
+
+  // Optional side-by-side cost of both schemes over the first -scheme_compare steps
+  PetscInt ncompare = 0;
+  ierr = PetscOptionsGetInt(NULL, NULL, "-scheme_compare", &ncompare, NULL); CHKERRQ(ierr);
+  if ((ncompare > 0) && ctx.wf.single)
+  {
+    SETERRQ(comm, PETSC_ERR_SUP, "-scheme_compare runs the explicit scheme, which -history_float does not support");
+  }
+  if (ncompare > 0)
+  {
+    ierr = source_locate(pctx);   CHKERRQ(ierr);
+    if (ctx.dev.on)
+    {
+      ierr = device_source(pctx);   CHKERRQ(ierr);
+    }
+    ierr = compare_schemes(ksp_u, b, &ctx, ncompare, dt_implicit, dt_explicit);   CHKERRQ(ierr);
+  }
+
+  /*
+    TIME LOOP, ONCE PER SHOT
+  */
+  ierr = PetscLogStagePop();   CHKERRQ(ierr);
+  ierr = PetscLogStagePush(ctx.log.loop);   CHKERRQ(ierr);
+  double loop_begin = MPI_Wtime();
+
+  if (!resume)
+  {
+    ierr = next_shot(pctx);   CHKERRQ(ierr);
+  }
+  while (ctx.shot < ctx.nshots)
+  {
+    // Every shot starts from rest, A and its preconditioner are kept from the previous one
+    for (i = 0; i < 4; i++)
+    {
+      ierr = VecSet(ctx.wf.level[i], 0.f);   CHKERRQ(ierr);
+      active_mark(pctx, i, PETSC_FALSE);
+    }
+    ierr = PetscMemzero(ctx.rec.trace, ctx.rec.nloc * ctx.rec.nbuf * sizeof(PetscScalar));   CHKERRQ(ierr);
+    if (ctx.wf.single)
+    {
+      PetscInt nloc;
+      ierr = VecGetLocalSize(ctx.wf.level[0], &nloc);   CHKERRQ(ierr);
+      for (i = 0; i < 4; i++)
+      {
+        ierr = PetscMemzero(ctx.wf.hist[i], nloc * sizeof(float));   CHKERRQ(ierr);
+      }
+    }
+    if (ctx.rec.check)
+    {
+      ierr = accuracy_setup(pctx);   CHKERRQ(ierr);
+    }
+    ierr = source_locate(pctx);   CHKERRQ(ierr);
+    if (ctx.dev.on)
+    {
+      ierr = device_source(pctx);   CHKERRQ(ierr);
+    }
+    if (resume)
+    {
+      ierr = checkpoint_load(resume, b, pctx);   CHKERRQ(ierr);     // Also destroys the viewer
+      resume = NULL;
+      ierr = PetscPrintf(PETSC_COMM_WORLD, "RESTART: \t shot %i from step %i \n\n", ctx.shot, ctx.time.it0 + 1); CHKERRQ(ierr);
+    }
+    else if (ctx.ckpt.every)
+    {
+      ctx.time.it = 0;
+      ierr = checkpoint_write(b, pctx);   CHKERRQ(ierr);            // Marks the shot as taken by this group
+    }
+    if (ctx.rec.format == SEIS_BINARY)
+    {
+      ierr = seis_file_open(pctx);   CHKERRQ(ierr);
+    }
+    if (ctx.nshots > 1)
+    {
+      ierr = PetscPrintf(PETSC_COMM_WORLD, "SHOT %i of %i: \t ISRC %i \t GROUP %i \n", ctx.shot + 1, ctx.nshots, 
+                         ctx.src[ctx.shot].isrc, ctx.queue.group);   CHKERRQ(ierr);
+    }
+
+    // A resumed shot has no forward |u| before it0, the replay check skips the zero entries
+    if (ctx.rtm.norm)
+    {
+      ierr = PetscMemzero(ctx.rtm.norm, ctx.time.it0 * sizeof(PetscReal));   CHKERRQ(ierr);
+    }
+
+    double begin = MPI_Wtime();
+    double end;
+
+    int it;
+    for (it  = ctx.time.it0 + 1; it <= *pnt; it ++)
+    {
+      ctx.time.it = it;
+      ctx.time.t = (PetscScalar) (it-1) * ctx.time.dt;
+      u = WF_LEVEL(ctx.wf, it, 0);                                        // Slot of T-4, overwritten by the step
+      double step_begin = MPI_Wtime();
+    
+      ierr = time_step(ksp_u, b, &ctx);   CHKERRQ(ierr);                  // Solve or explicit update for u
+    
+      ierr = Write_seismograms(ksp_u, u, &ctx); CHKERRQ(ierr);            // Append value to the seismograms
+      if (ctx.out.async)
+      {
+        ierr = snapshot_async_progress(&ctx); CHKERRQ(ierr);              // Background snapshot writes
+      }
+      if (ctx.rtm.norm)
+      {
+        ierr = VecNorm(u, NORM_2, &ctx.rtm.norm[it - 1]);   CHKERRQ(ierr);
+      }
+      if (ctx.ckpt.every && (it % ctx.ckpt.every == 0) && (it < *pnt))
+      {
+        ierr = checkpoint_write(b, pctx);   CHKERRQ(ierr);
+      }
+
+      if (ctx.log.csv)
+      {
+        PetscReal rnorm = 0.f;
+        if (!ctx.solver.explicit_scheme)
+        {
+          ierr = KSPGetResidualNorm(ksp_u, &rnorm);   CHKERRQ(ierr);
+        }
+        ierr = PetscFPrintf(comm, ctx.log.csv, "%i,%i,%g,%i,%g\n", ctx.shot, it, MPI_Wtime() - step_begin, 
+                            ctx.solver.explicit_scheme ? 0 : ctx.solver.its, (double) rnorm);   CHKERRQ(ierr);
+      }
+
+
+      if (ctx.log.display_every && (it % ctx.log.display_every == 0))
+      { 
+        if (ctx.log.display)
+        {
+          end = MPI_Wtime();
+          ierr = PetscPrintf(PETSC_COMM_WORLD, "Time step: \t %i of %i\n", ctx.time.it, ctx.time.nt);   CHKERRQ(ierr);
+
+          if (ctx.log.display_stats)
+          {
+            PetscReal stats[3];
+            ierr = wavefield_stats(u, pctx, stats); CHKERRQ(ierr);
+            ierr = PetscPrintf(PETSC_COMM_WORLD, "u max: \t %g \n", (double) stats[0]); CHKERRQ(ierr);
+            ierr = PetscPrintf(PETSC_COMM_WORLD, "u min: \t %g \n", (double) stats[1]); CHKERRQ(ierr);
+            ierr = PetscPrintf(PETSC_COMM_WORLD, "NORM: \t %g \n", (double) stats[2]); CHKERRQ(ierr);
+          }
+
+          double time_spent = end - begin;
+          ierr = PetscPrintf(PETSC_COMM_WORLD, "Elapsed time: \t %f sec \n", time_spent); CHKERRQ(ierr);
+          if (!ctx.solver.explicit_scheme)
+          {
+            ierr = PetscPrintf(PETSC_COMM_WORLD, "KSP iterations: \t %i \n", ctx.solver.its); CHKERRQ(ierr);
+          }
+        }
+
+        if (ctx.out.save && (ctx.shot == 0))     // Snapshots of the first shot only
+        {
+          ierr = save_snapshot(u, &ctx); CHKERRQ(ierr);
+        }
+
+        if (ctx.log.display)
+        {
+          ierr = PetscPrintf(PETSC_COMM_WORLD, "\n"); CHKERRQ(ierr);
+          begin = MPI_Wtime();
+        }
+      }
+    }
+
+    if (ctx.rec.check)
+    {
+      ierr = accuracy_report(pctx);   CHKERRQ(ierr);
+    }
+
+    ierr = PetscLogStagePush(ctx.log.output);   CHKERRQ(ierr);
+    if (ctx.rec.format == SEIS_BINARY)
+    {
+      ierr = seis_file_close(pctx);   CHKERRQ(ierr);                      // Last chunk was flushed at it = nt
+    }
+    else
+    {
+      ierr = Save_seismograms_to_txt_files(ksp_u, pctx);   CHKERRQ(ierr);   // Write seismograms into .txt files
+    }
+    ierr = PetscLogStagePop();   CHKERRQ(ierr);
+
+    if (ctx.rtm.on)
+    {
+      ierr = rtm_replay(ksp_u, b, pctx);   CHKERRQ(ierr);
+    }
+
+    ctx.queue.done++;
+    ctx.time.steps += *pnt - ctx.time.it0;
+    ctx.time.it0 = 0;
+    ierr = next_shot(pctx);   CHKERRQ(ierr);
+  }
+
+  double loop_time = MPI_Wtime() - loop_begin;
+  ierr = PetscLogStagePop();   CHKERRQ(ierr);
+
+  if (ctx.out.async)
+  {
+    ierr = snapshot_async_flush(&ctx);   CHKERRQ(ierr);                   // Wait for the last snapshots
+  }
+
+  // COST PER STEP
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\nCOST PER STEP (%s): \n", 
+                     ctx.solver.explicit_scheme ? "explicit" : "implicit"); CHKERRQ(ierr);
+  PetscInt nsteps = PetscMax(ctx.time.steps, 1);                       // Steps run by this group, restarts included
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Shots \t %i of %i, group %i of %i \n", 
+                     ctx.queue.done, ctx.nshots, ctx.queue.group, ctx.queue.ngroups); CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Wall time per step \t %g sec \n", loop_time / nsteps); CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Wall time per simulated second \t %g sec \n", 
+                     loop_time / (nsteps * ctx.time.dt)); CHKERRQ(ierr);
+  if (!ctx.solver.explicit_scheme)
+  {
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Total KSP iterations \t %i \n", ctx.solver.its_total); CHKERRQ(ierr);
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "\t KSP iterations per step \t %f \n", 
+                       (double) ctx.solver.its_total / nsteps); CHKERRQ(ierr);
+  }
+  PetscReal updates = (loop_time > 0.f) ? (PetscReal) ctx.active.n[0] * ctx.active.n[1] * ctx.active.n[2] * nsteps / loop_time : 0.f;
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Grid-point updates per second \t %g \n", (double) updates); CHKERRQ(ierr);
+  if (ctx.active.on && (ctx.active.full > 0.f))
+  {
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Active region \t %g of the full-grid node updates \n", 
+                       (double) (ctx.active.updated / ctx.active.full)); CHKERRQ(ierr);
+  }
+  PetscLogDouble mem, mem_max, mem_total;
+  ierr = PetscMemoryGetMaximumUsage(&mem);   CHKERRQ(ierr);
+  ierr = MPI_Allreduce(&mem, &mem_max, 1, MPI_DOUBLE, MPI_MAX, comm);   CHKERRQ(ierr);
+  ierr = MPI_Allreduce(&mem, &mem_total, 1, MPI_DOUBLE, MPI_SUM, comm);   CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Memory high-water mark \t %g MB per rank \t %g MB in total \n", 
+                     mem_max / 1048576.f, mem_total / 1048576.f); CHKERRQ(ierr);
+
+  /*
+    CLEAN ALLOCATIONS AND EXIT
+  */
+  ierr = VecDestroy(&b);     CHKERRQ(ierr);
+  ierr = VecDestroy(&ctx.model.vel2);   CHKERRQ(ierr);
+  ierr = PetscFree(ctx.src);   CHKERRQ(ierr);
+  ierr = PetscFree4(ctx.srcs.di, ctx.srcs.dj, ctx.srcs.dk, ctx.srcs.w);   CHKERRQ(ierr);
+  ierr = PetscFree2(ctx.srcs.loc, ctx.srcs.wloc);   CHKERRQ(ierr);
+  ierr = PetscFree(ctx.srcs.wavelet);   CHKERRQ(ierr);
+  ierr = PetscFree(ctx.srcs.file);   CHKERRQ(ierr);
+  ierr = PetscFree3(ctx.abc.g[0], ctx.abc.g[1], ctx.abc.g[2]);   CHKERRQ(ierr);
+  for (i = 0; i < 4; i++)
+  {
+    ierr = VecDestroy(&ctx.wf.level[i]);   CHKERRQ(ierr);
+  }
+  if (ctx.wf.single)
+  {
+    ierr = PetscFree4(ctx.wf.hist[0], ctx.wf.hist[1], ctx.wf.hist[2], ctx.wf.hist[3]);   CHKERRQ(ierr);
+  }
+
+  if (ctx.out.async)
+  {
+    for (i = 0; i < ctx.out.nslots; i++)
+    {
+      ierr = PetscFree(ctx.out.slots[i].buf);   CHKERRQ(ierr);
+    }
+    ierr = PetscFree(ctx.out.slots);   CHKERRQ(ierr);
+  }
+
+  ierr = PetscFree2(ctx.rec.id, ctx.rec.loc);   CHKERRQ(ierr);
+  ierr = PetscFree(ctx.rec.trace);   CHKERRQ(ierr);
+  ierr = PetscFree3(ctx.rec.dist, ctx.rec.amp, ctx.rec.tvalid);   CHKERRQ(ierr);
+  if (ctx.out.sub)
+  {
+    ierr = VecScatterDestroy(&ctx.out.pick);   CHKERRQ(ierr);
+    ierr = VecDestroy(&ctx.out.sub);   CHKERRQ(ierr);
+  }
+  if (ctx.rtm.on)
+  {
+    if (ctx.rtm.nslots)
+    {
+      ierr = VecDestroyVecs(3 * ctx.rtm.nslots, &ctx.rtm.slot);   CHKERRQ(ierr);
+    }
+    ierr = VecDestroy(&ctx.rtm.illum);   CHKERRQ(ierr);
+    ierr = PetscFree(ctx.rtm.norm);   CHKERRQ(ierr);
+  }
+  if (ctx.dev.on)
+  {
+    ierr = VecDestroy(&ctx.dev.interior);   CHKERRQ(ierr);
+    ierr = VecDestroy(&ctx.dev.delta);   CHKERRQ(ierr);
+    ierr = VecDestroy(&ctx.dev.work);   CHKERRQ(ierr);
+    for (i = 0; i < 3; i++)
+    {
+      ierr = VecDestroy(&ctx.dev.g[i]);   CHKERRQ(ierr);
+    }
+    ierr = VecScatterDestroy(&ctx.dev.gather);   CHKERRQ(ierr);
+    ierr = VecDestroy(&ctx.dev.rec_u);   CHKERRQ(ierr);
+  }
+
+  ierr = MatDestroy(&A);      CHKERRQ(ierr);
+  ierr = MatNullSpaceDestroy(&ctx.solver.nullspace);   CHKERRQ(ierr);
+  ierr = KSPDestroy(&ksp_u); CHKERRQ(ierr);
+  ierr = DMDestroy(&da);     CHKERRQ(ierr);
+  
+  if (ctx.log.csv)
+  {
+    ierr = PetscFClose(comm, ctx.log.csv);   CHKERRQ(ierr);
+  }
+
+  // Print out total elapsed wall time
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\n Please check ./seism/ for seismograms\n"); CHKERRQ(ierr);
+  double time_spent = MPI_Wtime() - total_time_begin;
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\n"); CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "Total time: \t %f sec \n", time_spent); CHKERRQ(ierr);
+
+  // Machine-readable summary of the run, for tracking the performance across runs
+  FILE *summary;
+  PetscMPIInt size;
+  ierr = MPI_Comm_size(comm, &size);   CHKERRQ(ierr);
+  ierr = PetscFOpen(comm, summary_file, "w", &summary);   CHKERRQ(ierr);
+  ierr = PetscFPrintf(comm, summary, "{\n"
+                      "  \"scheme\": \"%s\",\n"
+                      "  \"order\": %i,\n"
+                      "  \"grid\": [%i, %i, %i],\n"
+                      "  \"ranks\": %i,\n"
+                      "  \"group\": %i,\n"
+                      "  \"groups\": %i,\n"
+                      "  \"shots\": %i,\n"
+                      "  \"steps\": %i,\n",
+                      ctx.solver.explicit_scheme ? "explicit" : "implicit", ctx.stencil.order,
+                      ctx.active.n[0], ctx.active.n[1], ctx.active.n[2], size, ctx.queue.group, ctx.queue.ngroups,
+                      ctx.queue.done, nsteps);   CHKERRQ(ierr);
+  ierr = PetscFPrintf(comm, summary, 
+                      "  \"loop_time_sec\": %g,\n"
+                      "  \"time_per_step_sec\": %g,\n"
+                      "  \"grid_point_updates_per_sec\": %g,\n"
+                      "  \"ksp_iterations_total\": %i,\n"
+                      "  \"ksp_iterations_per_step\": %g,\n"
+                      "  \"memory_peak_mb_per_rank\": %g,\n"
+                      "  \"memory_peak_mb_total\": %g,\n"
+                      "  \"total_time_sec\": %g\n"
+                      "}\n",
+                      loop_time, loop_time / nsteps, (double) updates, ctx.solver.its_total,
+                      (double) ctx.solver.its_total / nsteps, mem_max / 1048576.f, mem_total / 1048576.f, 
+                      time_spent);   CHKERRQ(ierr);
+  ierr = PetscFClose(comm, summary);   CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "Summary: \t %s \n", summary_file); CHKERRQ(ierr);
+
+  ierr = MPI_Op_free(&ctx.log.stats_op);   CHKERRQ(ierr);
+  ierr = MPI_Type_free(&ctx.log.stats_type);   CHKERRQ(ierr);
+
+  ierr = MPI_Win_free(&ctx.queue.win);   CHKERRQ(ierr);
+  ierr = PetscFinalize();   CHKERRQ(ierr);
+
+  // MPI was started here, so it is closed here too
+  MPI_Comm_free(&group_comm);
+  MPI_Finalize();
+
+  return 0;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+// APPEND VALUE TO A SEISMOGRAM
+PetscErrorCode
+Write_seismograms(KSP ksp, Vec u ,void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+
+  const PetscScalar *_u;
+
+  ctx_t *c = (ctx_t *) ctx;
+  ierr = PetscLogEventBegin(c->log.seis, 0, 0, 0, 0);   CHKERRQ(ierr);
+
+  PetscInt it = c->time.it;
+  PetscInt nbuf = c->rec.nbuf;
+  PetscScalar *trace = c->rec.trace + (it - 1) % nbuf;
+  PetscInt r;
+
+  if (c->dev.on)
+  {
+    // Only the owned samples leave the device, not the whole of u
+    ierr = VecScatterBegin(c->dev.gather, u, c->dev.rec_u, INSERT_VALUES, SCATTER_FORWARD);   CHKERRQ(ierr);
+    ierr = VecScatterEnd(c->dev.gather, u, c->dev.rec_u, INSERT_VALUES, SCATTER_FORWARD);   CHKERRQ(ierr);
+    ierr = VecGetArrayRead(c->dev.rec_u, &_u);   CHKERRQ(ierr);
+    for (r = 0; r < c->rec.nloc; r++)
+    {
+      trace[r * nbuf] = _u[r];
+    }
+    ierr = VecRestoreArrayRead(c->dev.rec_u, &_u);   CHKERRQ(ierr);
+  }
+  else
+  {
+    // Gather from the offsets resolved in locate_receivers
+    const PetscInt *loc = c->rec.loc;
+
+    ierr = VecGetArrayRead(u, &_u);   CHKERRQ(ierr);
+    for (r = 0; r < c->rec.nloc; r++)
+    {
+      trace[r * nbuf] = _u[loc[r]];
+    }
+    ierr = VecRestoreArrayRead(u, &_u);   CHKERRQ(ierr);
+  }
+
+  // Misfit to the analytic solution, only until the first reflection from the boundaries arrives
+  if (c->rec.check)
+  {
+    PetscScalar t = c->time.t, a;
+    for (r = 0; r < c->rec.nloc; r++)
+    {
+      if (t < c->rec.tvalid[r])
+      {
+        a = c->rec.amp[r] * ricker(c->src[c->shot].f0, t - c->rec.dist[r] / c->model.vel);
+        c->rec.misfit[0] += pow(trace[r * nbuf] - a, 2);
+        c->rec.misfit[1] += pow(a, 2);
+      }
+    }
+  }
+
+  // A full chunk, or the last step, goes to the file. Every rank calls this at the same step
+  if ((c->rec.format == SEIS_BINARY) && ((it % nbuf == 0) || (it == c->time.nt)))
+  {
+    ierr = seis_file_flush(ctx);   CHKERRQ(ierr);
+  }
+
+  ierr = PetscLogEventEnd(c->log.seis, 0, 0, 0, 0);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+} 
+
+
+
+
+
+
+// ADVANCE THE WAVEFIELD TO c->time.it, THE NEW LEVEL IS WF_LEVEL(c->wf, it, 0)
+PetscErrorCode
+time_step(KSP ksp, Vec b, void * ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  ctx_t *c = (ctx_t *) ctx;
+  Vec u = WF_LEVEL(c->wf, c->time.it, 0);
+  PetscErrorCode (*rhs)(KSP, Vec, void *) = c->dev.on ? update_b_vec : update_b_u;
+
+  if (c->solver.explicit_scheme)
+  {
+    ierr = explicit_step(ksp, u, c);   CHKERRQ(ierr);                    // Direct ghosted stencil update
+  }
+  else
+  {
+    if (c->solver.matfree)
+    {
+      ierr = rhs(ksp, b, c);   CHKERRQ(ierr);                             // new rhs for next iteration
+    }
+    else
+    {
+      ierr = KSPSetComputeRHS(ksp, rhs, c);   CHKERRQ(ierr);              // new rhs for next iteration
+    }
+
+    // The predictor of the initial guess is written by update_b_u or update_b_vec, in the same pass
+
+    ierr = PetscLogEventBegin(c->log.solve, 0, 0, 0, 0);   CHKERRQ(ierr);
+    ierr = KSPSolve(ksp, b, u);   CHKERRQ(ierr);                          // Solve the linear system using KSP
+    ierr = PetscLogEventEnd(c->log.solve, 0, 0, 0, 0);   CHKERRQ(ierr);
+
+    // The new level joins the float history, the Vec is reused by the next solve
+    if (c->wf.single)
+    {
+      DMDALocalInfo grid;
+      const PetscScalar *_u;
+      float *h = WF_HIST(c->wf, c->time.it, 0);
+
+      ierr = DMDAGetLocalInfo(c->solver.da, &grid);   CHKERRQ(ierr);
+      ierr = VecGetArrayRead(u, &_u);   CHKERRQ(ierr);
+      PetscInt j, k;
+      OMP_FOR_ROWS
+      for(k = 0; k < grid.zm; k++)      // Depth
+      {
+        for(j = 0; j < grid.ym; j++)    // Columns
+        {
+          PetscInt i, off = (k * grid.ym + j) * grid.xm;
+          for(i = off; i < off + grid.xm; i++)
+          {
+            h[i] = (float) _u[i];
+          }
+        }
+      }
+      ierr = VecRestoreArrayRead(u, &_u);   CHKERRQ(ierr);
+    }
+
+    ierr = KSPGetIterationNumber(ksp, &c->solver.its);   CHKERRQ(ierr);
+    c->solver.its_total += c->solver.its;
+    if (c->solver.log_its)
+    {
+      ierr = PetscPrintf(PETSC_COMM_WORLD, "Step %i \t KSP iterations %i \n", c->time.it, c->solver.its); CHKERRQ(ierr);
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+
+
+
+// TIME BOTH SCHEMES OVER THE FIRST nsteps AND PRINT THE COST OF EACH
+PetscErrorCode
+compare_schemes(KSP ksp, Vec b, void * ctx, PetscInt nsteps, PetscScalar dt_implicit, PetscScalar dt_explicit)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  ctx_t *c = (ctx_t *) ctx;
+  MPI_Comm comm = PETSC_COMM_WORLD;
+
+  PetscBool explicit_scheme = c->solver.explicit_scheme;  // Restored at the end
+  PetscScalar dt = c->time.dt;
+  PetscScalar dts[2] = {dt_implicit, dt_explicit};
+  PetscErrorCode (*rhs)(KSP, Vec, void *) = c->dev.on ? update_b_vec : update_b_u;
+  double cost[2];
+
+  int s, l;
+  for (s = 0; s < 2; s++)
+  {
+    c->solver.explicit_scheme = (PetscBool) s;
+    c->time.dt = dts[s];
+    ierr = wavelet_table(c);   CHKERRQ(ierr);
+
+    for (l = 0; l < 4; l++)
+    {
+      ierr = VecSet(c->wf.level[l], 0.f);   CHKERRQ(ierr);
+      active_mark(c, l, PETSC_FALSE);
+    }
+
+    // Keep operator assembly and preconditioner setup out of the implicit timing
+    c->time.it = 1;
+    c->time.t = 0.f;
+    if (!s)
+    {
+      if (c->solver.matfree)
+      {
+        ierr = rhs(ksp, b, c);   CHKERRQ(ierr);
+      }
+      else
+      {
+        ierr = KSPSetComputeRHS(ksp, rhs, c);   CHKERRQ(ierr);
+      }
+      ierr = KSPSetUp(ksp);   CHKERRQ(ierr);
+    }
+
+    ierr = MPI_Barrier(comm);   CHKERRQ(ierr);
+    double begin = MPI_Wtime();
+
+    PetscInt it;
+    for (it = 1; it <= nsteps; it++)
+    {
+      c->time.it = it;
+      c->time.t = (PetscScalar) (it-1) * c->time.dt;
+      ierr = time_step(ksp, b, c);   CHKERRQ(ierr);
+    }
+
+    ierr = MPI_Barrier(comm);   CHKERRQ(ierr);
+    cost[s] = (MPI_Wtime() - begin) / nsteps;
+  }
+
+  // Restore the run configuration and the zero initial state
+  c->solver.explicit_scheme = explicit_scheme;
+  c->time.dt = dt;
+  ierr = wavelet_table(c);   CHKERRQ(ierr);
+  c->solver.its_total = 0;
+  c->active.updated = 0.f;
+  c->active.full = 0.f;
+  for (l = 0; l < 4; l++)
+  {
+    ierr = VecSet(c->wf.level[l], 0.f);   CHKERRQ(ierr);
+    active_mark(c, l, PETSC_FALSE);
+  }
+
+  ierr = PetscPrintf(comm, "SCHEME COMPARISON OVER %i STEPS: \n", nsteps); CHKERRQ(ierr);
+  ierr = PetscPrintf(comm, "\t SCHEME \t DT \t\t SEC/STEP \t SEC/SIMULATED SEC \n"); CHKERRQ(ierr);
+  ierr = PetscPrintf(comm, "\t implicit \t %f \t %g \t %g \n", dts[0], cost[0], cost[0] / dts[0]); CHKERRQ(ierr);
+  ierr = PetscPrintf(comm, "\t explicit \t %f \t %g \t %g \n", dts[1], cost[1], cost[1] / dts[1]); CHKERRQ(ierr);
+  ierr = PetscPrintf(comm, "\t Implicit pays off when its DT is more than %g times the explicit DT \n", 
+                     cost[0] / cost[1]); CHKERRQ(ierr);
+  ierr = PetscPrintf(comm, "\n"); CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+
+
+
+// EXPLICIT LEAPFROG STEP u = 2 um1 - um2 + dt2 * (vel2 * Laplacian(um1) + source)
+PetscErrorCode
+explicit_step(KSP ksp, Vec u, void * ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscScalar dt2, vel2, w[3];
+  PetscScalar ***_u;
+  const PetscScalar ***_um1, ***_um1loc, ***_um2, ***_c2 = NULL;
+  Vec um1, um2, um1loc, vel2_level;
+  DM da;
+  DMDALocalInfo grid;
+
+  ctx_t *c = (ctx_t *) ctx;
+  ierr = PetscLogEventBegin(c->log.leapfrog, 0, 0, 0, 0);   CHKERRQ(ierr);
+  PetscInt it = c->time.it;
+
+  source_term(c);
+  dt2 = pow(c->time.dt, 2);
+  vel2 = pow(c->model.vel, 2);
+
+  ierr = KSPGetDM(ksp, &da);   CHKERRQ(ierr); //Get the DM oject of the KSP
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);
+
+  // Weights of the second derivative along each axis, dt2 / h2, explicit_box scales them by vel2
+  w[0] = dt2 / pow(c->model.dx, 2);
+  w[1] = dt2 / pow(c->model.dy, 2);
+  w[2] = dt2 / pow(c->model.dz, 2);
+
+  ierr = velocity_on_level(da, c, &vel2_level);   CHKERRQ(ierr);
+  if (vel2_level)
+  {
+    ierr = DMDAVecGetArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+
+  um1 = WF_LEVEL(c->wf, it, 1);
+  um2 = WF_LEVEL(c->wf, it, 2);
+
+  // Start the halo exchange of um1 and update the nodes that need no ghosts meanwhile
+  ierr = DMGetLocalVector(da, &um1loc);   CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(da, um1, INSERT_VALUES, um1loc);   CHKERRQ(ierr);
+
+  ierr = DMDAVecGetArray(da, u, &_u);   CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(da, um1, &_um1);   CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(da, um2, &_um2);   CHKERRQ(ierr);
+
+  PetscInt xe = grid.xs + grid.xm, ye = grid.ys + grid.ym, ze = grid.zs + grid.zm;
+  PetscInt rs = c->stencil.radius;
+  PetscInt xi0 = PetscMin(grid.xs + rs, xe), xi1 = PetscMax(xe - rs, xi0);   // Inner box, off by the stencil radius
+  PetscInt yi0 = PetscMin(grid.ys + rs, ye), yi1 = PetscMax(ye - rs, yi0);
+  PetscInt zi0 = PetscMin(grid.zs + rs, ze), zi1 = PetscMax(ze - rs, zi0);
+
+  PetscInt inner[6] = {xi0, xi1, yi0, yi1, zi0, zi1};
+  PetscScalar **g = c->abc.width ? c->abc.g : NULL;
+
+  // Every box of the sweep is clipped to the active one, ranks outside of it only join the halo exchange
+  PetscInt active[6] = {0, grid.mx, 0, grid.my, 0, grid.mz};
+  PetscInt a, i, j, k;
+  if (c->active.on)
+  {
+    PetscInt *stale = c->active.box[WF_SLOT(it, 0)];
+    active_box(c, active);
+
+    // The overwritten level has to be zero outside of the new box
+    if ((stale[0] < stale[1]) && (stale[2] < stale[3]) && (stale[4] < stale[5]) &&
+        ((stale[0] < active[0]) || (stale[1] > active[1]) || (stale[2] < active[2]) ||
+         (stale[3] > active[3]) || (stale[4] < active[4]) || (stale[5] > active[5])))
+    {
+      for (k = PetscMax(stale[4], grid.zs); k < PetscMin(stale[5], ze); k++)
+        for (j = PetscMax(stale[2], grid.ys); j < PetscMin(stale[3], ye); j++)
+          for (i = PetscMax(stale[0], grid.xs); i < PetscMin(stale[1], xe); i++)
+            _u[k][j][i] = 0.f;
+    }
+    for (a = 0; a < 6; a++) stale[a] = active[a];
+
+    c->active.updated += (PetscReal) (active[1] - active[0]) * (active[3] - active[2]) * (active[5] - active[4]);
+    c->active.full += (PetscReal) grid.mx * grid.my * grid.mz;
+  }
+  for (a = 0; a < 3; a++)
+  {
+    inner[2 * a] = PetscMax(inner[2 * a], active[2 * a]);
+    inner[2 * a + 1] = PetscMax(PetscMin(inner[2 * a + 1], active[2 * a + 1]), inner[2 * a]);
+  }
+
+  ierr = c->stencil.explicit_box(&grid, w, vel2, _c2, g, _u, _um1, _um2, inner);   CHKERRQ(ierr);
+
+  ierr = DMGlobalToLocalEnd(da, um1, INSERT_VALUES, um1loc);   CHKERRQ(ierr);
+  ierr = DMDAVecGetArrayRead(da, um1loc, &_um1loc);   CHKERRQ(ierr);
+
+  // Remaining rind of the subdomain, it reads the ghosts
+  PetscInt rind[6][6] = {{grid.xs, xe, grid.ys, ye, grid.zs, zi0},
+                         {grid.xs, xe, grid.ys, ye, zi1, ze},
+                         {grid.xs, xe, grid.ys, yi0, zi0, zi1},
+                         {grid.xs, xe, yi1, ye, zi0, zi1},
+                         {grid.xs, xi0, yi0, yi1, zi0, zi1},
+                         {xi1, xe, yi0, yi1, zi0, zi1}};
+  int r;
+  for (r = 0; r < 6; r++)
+  {
+    for (a = 0; a < 3; a++)
+    {
+      rind[r][2 * a] = PetscMax(rind[r][2 * a], active[2 * a]);
+      rind[r][2 * a + 1] = PetscMax(PetscMin(rind[r][2 * a + 1], active[2 * a + 1]), rind[r][2 * a]);
+    }
+    ierr = c->stencil.explicit_box(&grid, w, vel2, _c2, g, _u, _um1loc, _um2, rind[r]);   CHKERRQ(ierr);
+  }
+
+  // Point sources, added after the sweep at their offsets in the owned block
+  PetscScalar *u0 = &_u[grid.zs][grid.ys][grid.xs], force = dt2 * c->src[c->shot].fx;
+  PetscInt p;
+  for (p = 0; p < c->srcs.nloc; p++)
+  {
+    u0[c->srcs.loc[p]] += force * c->srcs.wloc[p];
+  }
+
+  ierr = DMDAVecRestoreArray(da, u, &_u);   CHKERRQ(ierr);                  // Release the resource
+  ierr = DMDAVecRestoreArrayRead(da, um1, &_um1);   CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArrayRead(da, um2, &_um2);   CHKERRQ(ierr);
+  ierr = DMDAVecRestoreArrayRead(da, um1loc, &_um1loc);   CHKERRQ(ierr);
+  ierr = DMRestoreLocalVector(da, &um1loc);   CHKERRQ(ierr);
+  if (vel2_level)
+  {
+    ierr = DMDAVecRestoreArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+
+  ierr = PetscLogEventEnd(c->log.leapfrog, 0, 0, 0, 0);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// MAX, MIN AND 2-NORM OF u, {max, min, norm}, WITH ONE PASS OVER THE OWNED NODES AND ONE MPI_Allreduce
+// Device Vecs keep their own reductions, so u is not copied to the host for a progress report
+PetscErrorCode
+wavefield_stats(Vec u, void *ctx, PetscReal *stats)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  const PetscScalar *_u;
+  PetscInt i, n;
+  MPI_Comm comm;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  if (c->dev.on)
+  {
+    ierr = VecMax(u, NULL, &stats[0]);   CHKERRQ(ierr);
+    ierr = VecMin(u, NULL, &stats[1]);   CHKERRQ(ierr);
+    ierr = VecNorm(u, NORM_2, &stats[2]);   CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+  }
+
+  ierr = PetscObjectGetComm((PetscObject) u, &comm);   CHKERRQ(ierr);
+  ierr = VecGetLocalSize(u, &n);   CHKERRQ(ierr);
+  ierr = VecGetArrayRead(u, &_u);   CHKERRQ(ierr);
+  PetscReal hi = PETSC_MIN_REAL, lo = PETSC_MAX_REAL, sum = 0.f;
+#if defined(_OPENMP)
+  _Pragma("omp parallel for schedule(static) reduction(max:hi) reduction(min:lo) reduction(+:sum)")
+#endif
+  for (i = 0; i < n; i++)
+  {
+    PetscReal v = PetscRealPart(_u[i]);
+    hi = PetscMax(hi, v);
+    lo = PetscMin(lo, v);
+    sum += v * v;
+  }
+  ierr = VecRestoreArrayRead(u, &_u);   CHKERRQ(ierr);
+
+  PetscReal local[3] = {hi, lo, sum};
+  ierr = MPI_Allreduce(local, stats, 1, c->log.stats_type, c->log.stats_op, comm);   CHKERRQ(ierr);
+  stats[2] = PetscSqrtReal(stats[2]);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// COMBINE {max, min, sum of squares} TRIPLETS, THE MPI_Op OF wavefield_stats
+void
+stats_reduce(void *in, void *inout, int *len, MPI_Datatype *type)
+{
+  PetscReal *a = (PetscReal *) in, *b = (PetscReal *) inout;
+  int i;
+
+  for (i = 0; i < *len; i++, a += 3, b += 3)
+  {
+    b[0] = PetscMax(a[0], b[0]);
+    b[1] = PetscMin(a[1], b[1]);
+    b[2] += a[2];
+  }
+}
+
+
+
+// SAVE VECTOR TO .m FILE
+PetscErrorCode
+save_Vec_to_m_file(Vec u, void * filename)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  char * filename2 = (char *) filename;
+
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "File created: %s .m \n",filename2); CHKERRQ(ierr);
+  PetscViewer viewer;
+  PetscViewerASCIIOpen(PETSC_COMM_WORLD, filename2, &viewer);
+  PetscViewerPushFormat(viewer, PETSC_VIEWER_ASCII_MATLAB);
+  VecView(u, viewer);
+  PetscViewerPopFormat(viewer);
+  PetscViewerDestroy(&viewer);
+
+  PetscFunctionReturn(0);
+}
+
+
+// SAVE WAVEFIELD SNAPSHOT OF THE CURRENT TIME STEP
+PetscErrorCode
+save_snapshot(Vec u, void * ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  PetscViewer viewer;
+  char buffer[64];
+
+  ctx_t *c = (ctx_t *) ctx;
+  ierr = PetscLogEventBegin(c->log.snapshot, 0, 0, 0, 0);   CHKERRQ(ierr);
+  MPI_Comm comm;
+  ierr = PetscObjectGetComm((PetscObject) u, &comm);   CHKERRQ(ierr);
+
+  // Only the slice or the strided sub-volume is gathered and written
+  if (c->out.sub)
+  {
+    ierr = VecScatterBegin(c->out.pick, u, c->out.sub, INSERT_VALUES, SCATTER_FORWARD);   CHKERRQ(ierr);
+    ierr = VecScatterEnd(c->out.pick, u, c->out.sub, INSERT_VALUES, SCATTER_FORWARD);   CHKERRQ(ierr);
+    u = c->out.sub;
+  }
+
+  switch (c->out.format)
+  {
+    case SNAPSHOT_ASCII:
+      snprintf(buffer, sizeof(buffer), "./wavefields/tmp_Bvec_%i.m", c->time.it);
+      ierr = save_Vec_to_m_file(u, &buffer); CHKERRQ(ierr);
+      break;
+
+    // DMDA-ordered parallel write, through MPI-IO when PETSc has it
+    case SNAPSHOT_BINARY:
+      if (c->out.async)
+      {
+        ierr = snapshot_async_write(u, c);   CHKERRQ(ierr);
+        break;
+      }
+      snprintf(buffer, sizeof(buffer), "./wavefields/tmp_Bvec_%i.bin", c->time.it);
+      ierr = PetscPrintf(comm, "File created: %s \n", buffer); CHKERRQ(ierr);
+      ierr = PetscViewerCreate(comm, &viewer);   CHKERRQ(ierr);
+      ierr = PetscViewerSetType(viewer, PETSCVIEWERBINARY);   CHKERRQ(ierr);
+      ierr = PetscViewerBinarySkipInfo(viewer);   CHKERRQ(ierr);
+#if defined(PETSC_HAVE_MPIIO)
+      ierr = PetscViewerBinarySetUseMPIIO(viewer, PETSC_TRUE);   CHKERRQ(ierr);
+#endif
+      ierr = PetscViewerFileSetMode(viewer, FILE_MODE_WRITE);   CHKERRQ(ierr);
+      ierr = PetscViewerFileSetName(viewer, buffer);   CHKERRQ(ierr);
+      ierr = VecView(u, viewer);   CHKERRQ(ierr);
+      ierr = PetscViewerDestroy(&viewer);   CHKERRQ(ierr);
+      break;
+
+    // Collective HDF5 write, dataset /u of size [NZ][NY][NX]
+    case SNAPSHOT_HDF5:
+#if defined(PETSC_HAVE_HDF5)
+      snprintf(buffer, sizeof(buffer), "./wavefields/tmp_Bvec_%i.h5", c->time.it);
+      ierr = PetscPrintf(comm, "File created: %s \n", buffer); CHKERRQ(ierr);
+      ierr = PetscViewerHDF5Open(comm, buffer, FILE_MODE_WRITE, &viewer);   CHKERRQ(ierr);
+      ierr = PetscObjectSetName((PetscObject) u, "u");   CHKERRQ(ierr);
+      ierr = VecView(u, viewer);   CHKERRQ(ierr);
+      ierr = PetscViewerDestroy(&viewer);   CHKERRQ(ierr);
+#else
+      SETERRQ(comm, PETSC_ERR_SUP, "-snapshot_format hdf5 needs PETSc configured with HDF5");
+#endif
+      break;
+
+    case SNAPSHOT_COMPRESSED:
+      ierr = snapshot_compressed_write(u, c);   CHKERRQ(ierr);
+      break;
+  }
+
+  ierr = PetscLogEventEnd(c->log.snapshot, 0, 0, 0, 0);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+// REVERSE BYTE ORDER OF n ITEMS OF size BYTES, PETSc BINARY FILES ARE BIG-ENDIAN
+void
+swap_bytes(void * data, size_t size, PetscInt n)
+{
+#if !defined(PETSC_WORDS_BIGENDIAN)
+  char *p = (char *) data, tmp;
+  PetscInt i;
+  size_t b;
+
+  for (i = 0; i < n; i++, p += size)
+  {
+    for (b = 0; b < size / 2; b++)
+    {
+      tmp = p[b];
+      p[b] = p[size - 1 - b];
+      p[size - 1 - b] = tmp;
+    }
+  }
+#endif
+}
+
+
+
+// STAGE THE LOCAL BLOCK OF u AND START A NONBLOCKING MPI-IO WRITE OF IT
+// The file has the PETSc binary Vec layout (class id, size, values in natural ordering),
+// so it is read exactly like a synchronous -snapshot_format binary one
+PetscErrorCode
+snapshot_async_write(Vec u, void * ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  const PetscScalar *_u;
+  PetscInt nloc, N;
+  DM da;
+  DMDALocalInfo grid;
+  MPI_Comm comm;
+  MPI_Datatype ftype;
+  char buffer[64];
+
+  ctx_t *c = (ctx_t *) ctx;
+  snapshot_slot *slot = &c->out.slots[c->out.next];
+  c->out.next = (c->out.next + 1) % c->out.nslots;
+
+  ierr = PetscObjectGetComm((PetscObject) u, &comm);   CHKERRQ(ierr);
+  da = c->solver.da;
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);
+
+  // The pool is bounded: the oldest write is completed before its buffer is reused.
+  // Every rank reaches this point for the same snapshot, so the collective close matches
+  if (slot->busy)
+  {
+    ierr = MPI_Wait(&slot->req, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+    ierr = MPI_File_close(&slot->fh);   CHKERRQ(ierr);
+    slot->busy = PETSC_FALSE;
+  }
+
+  // Owned block of a DMDA Vec is contiguous with X fastest, as the natural ordering of the box
+  ierr = VecGetSize(u, &N);   CHKERRQ(ierr);
+  ierr = VecGetLocalSize(u, &nloc);   CHKERRQ(ierr);
+  ierr = VecGetArrayRead(u, &_u);   CHKERRQ(ierr);
+  ierr = PetscMemcpy(slot->buf, _u, nloc * sizeof(PetscScalar));   CHKERRQ(ierr);
+  ierr = VecRestoreArrayRead(u, &_u);   CHKERRQ(ierr);
+  swap_bytes(slot->buf, sizeof(PetscScalar), nloc);
+
+  snprintf(buffer, sizeof(buffer), "./wavefields/tmp_Bvec_%i.bin", c->time.it);
+  ierr = PetscPrintf(comm, "File started: %s \n", buffer); CHKERRQ(ierr);
+
+  ierr = MPI_File_open(comm, buffer, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &slot->fh);   CHKERRQ(ierr);
+  ierr = MPI_File_set_size(slot->fh, 0);   CHKERRQ(ierr);
+
+  // Header, written by the first rank only
+  PetscMPIInt rank;
+  ierr = MPI_Comm_rank(comm, &rank);   CHKERRQ(ierr);
+  if (!rank)
+  {
+    PetscInt header[2] = {VEC_FILE_CLASSID, N};
+    swap_bytes(header, sizeof(PetscInt), 2);
+    ierr = MPI_File_write_at(slot->fh, 0, header, 2, MPIU_INT, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+  }
+
+  // Each rank sees its box of the [NZ][NY][NX] array after the header
+  int sizes[3]    = {grid.mz, grid.my, grid.mx};
+  int subsizes[3] = {grid.zm, grid.ym, grid.xm};
+  int starts[3]   = {grid.zs, grid.ys, grid.xs};
+  ierr = MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPIU_SCALAR, &ftype);   CHKERRQ(ierr);
+  ierr = MPI_Type_commit(&ftype);   CHKERRQ(ierr);
+  ierr = MPI_File_set_view(slot->fh, (MPI_Offset) (2 * sizeof(PetscInt)), MPIU_SCALAR, ftype, 
+                           "native", MPI_INFO_NULL);   CHKERRQ(ierr);
+  ierr = MPI_Type_free(&ftype);   CHKERRQ(ierr);
+
+  ierr = MPI_File_iwrite(slot->fh, slot->buf, (int) nloc, MPIU_SCALAR, &slot->req);   CHKERRQ(ierr);
+  slot->busy = PETSC_TRUE;
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// SCATTER FROM u TO THE SUB-VOLUME OF THE SNAPSHOTS, BUILT ONCE
+// The nodes 0, stride, 2 stride ... of every axis are kept, and only slice_index along slice_axis.
+// sub is a plain Vec in the natural ordering of the sub-volume, X fastest, so every writer of save_snapshot
+// lays it out as an [NZ'][NY'][NX'] array. Each rank picks the entries of sub it owns, wherever they live in u
+PetscErrorCode
+snapshot_subset_setup(DM da, void *ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  PetscInt n[3], a, lo, hi, s, *idx;
+  AO ao;
+  IS from, to;
+
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt stride = c->out.stride;
+
+  if (stride < 1)
+  {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE, "-snapshot_stride must be positive");
+  }
+  ierr = DMDAGetInfo(da, 0, &n[0], &n[1], &n[2], 0,0,0,0,0,0,0,0,0);   CHKERRQ(ierr);
+  for (a = 0; a < 3; a++)
+  {
+    c->out.nsub[a] = (n[a] - 1) / stride + 1;
+  }
+  if (c->out.slice_axis >= 0)
+  {
+    if ((c->out.slice_index < 0) || (c->out.slice_index >= n[c->out.slice_axis]))
+    {
+      SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE, "-snapshot_slice index falls outside of the grid");
+    }
+    c->out.nsub[c->out.slice_axis] = 1;
+  }
+
+  PetscInt nx = c->out.nsub[0], ny = c->out.nsub[1];
+  ierr = VecCreateMPI(PETSC_COMM_WORLD, PETSC_DECIDE, nx * ny * c->out.nsub[2], &c->out.sub);   CHKERRQ(ierr);
+  ierr = VecGetOwnershipRange(c->out.sub, &lo, &hi);   CHKERRQ(ierr);
+
+  // Natural index of the full grid for every owned entry, then mapped to the PETSc ordering of u
+  ierr = PetscMalloc1(hi - lo, &idx);   CHKERRQ(ierr);
+  for (s = lo; s < hi; s++)
+  {
+    PetscInt p[3] = {s % nx, (s / nx) % ny, s / (nx * ny)};
+    for (a = 0; a < 3; a++)
+    {
+      p[a] = (a == c->out.slice_axis) ? c->out.slice_index : p[a] * stride;
+    }
+    idx[s - lo] = (p[2] * n[1] + p[1]) * n[0] + p[0];
+  }
+  ierr = DMDAGetAO(da, &ao);   CHKERRQ(ierr);
+  ierr = AOApplicationToPetsc(ao, hi - lo, idx);   CHKERRQ(ierr);
+
+  ierr = ISCreateGeneral(PETSC_COMM_WORLD, hi - lo, idx, PETSC_OWN_POINTER, &from);   CHKERRQ(ierr);
+  ierr = ISCreateStride(PETSC_COMM_WORLD, hi - lo, lo, 1, &to);   CHKERRQ(ierr);
+  ierr = VecScatterCreate(c->wf.level[0], from, c->out.sub, to, &c->out.pick);   CHKERRQ(ierr);
+  ierr = ISDestroy(&from);   CHKERRQ(ierr);
+  ierr = ISDestroy(&to);   CHKERRQ(ierr);
+
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "SNAPSHOTS: \t sub-volume %i x %i x %i \t %g of the grid \n\n", 
+                     nx, ny, c->out.nsub[2], (double) (nx * ny * c->out.nsub[2]) / (n[0] * n[1] * n[2])); CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// ERROR-BOUNDED LOSSY SNAPSHOT, IN THE SPIRIT OF SZ: EVERY RANK COMPRESSES ITS OWN BLOCK, THEN ONE COLLECTIVE WRITE.
+// Each node is predicted from its already reconstructed neighbors with the 3D Lorenzo predictor, zero outside of
+// the block, and the residual is quantized to q = round(residual / 2 eps), so |u - u_rec| <= eps everywhere.
+// The codes go out as LEB128 varints, 2 zigzag(q) + 1 for q != 0 and 2 n for a run of n zeros, which the quiet
+// and smooth parts of a pressure field are made of. Decoded by mfiles/subroutines/load_compressed_wavefield.m
+// Layout, big-endian: int32 magic, nranks, mx, my, mz; float64 eps;
+// per rank int32 xs, ys, zs, xm, ym, zm and int64 offset, bytes; then the blocks
+PetscErrorCode
+snapshot_compressed_write(Vec u, void * ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  const PetscScalar *_u;
+  PetscScalar *rec, umax;
+  unsigned char *buf;
+  size_t nbytes = 0, cap;
+  DMDALocalInfo grid;
+  PetscMPIInt rank, size;
+  MPI_Comm comm;
+  MPI_File fh;
+  char buffer[64];
+
+  ctx_t *c = (ctx_t *) ctx;
+  ierr = PetscObjectGetComm((PetscObject) u, &comm);   CHKERRQ(ierr);
+  ierr = MPI_Comm_rank(comm, &rank);   CHKERRQ(ierr);
+  ierr = MPI_Comm_size(comm, &size);   CHKERRQ(ierr);
+  ierr = DMDAGetLocalInfo(c->solver.da, &grid);   CHKERRQ(ierr);
+
+  ierr = VecNorm(u, NORM_INFINITY, &umax);   CHKERRQ(ierr);
+  PetscScalar eps = c->out.tolerance * umax;        // Zero for a field at rest, every code is then 0
+  PetscInt xm = grid.xm, ym = grid.ym, zm = grid.zm, nloc = xm * ym * zm;
+
+  cap = nloc + 16;                                  // Grows when a block does not compress to a byte per node
+  ierr = PetscMalloc1(cap, &buf);   CHKERRQ(ierr);
+  ierr = PetscMalloc1(nloc, &rec);   CHKERRQ(ierr);
+  ierr = VecGetArrayRead(u, &_u);   CHKERRQ(ierr);
+
+#define REC(a, b, d) ((((a) < 0) || ((b) < 0) || ((d) < 0)) ? 0.f : rec[((d) * ym + (b)) * xm + (a)])
+#define PUT_VARINT(value) do { unsigned long long v_ = (value);                                   \
+    if (nbytes + 10 > cap) { cap *= 2; ierr = PetscRealloc(cap, &buf); CHKERRQ(ierr); }          \
+    while (v_ >= 128) { buf[nbytes++] = (unsigned char) (v_ | 128); v_ >>= 7; }                   \
+    buf[nbytes++] = (unsigned char) v_; } while (0)
+
+  unsigned long long run = 0;
+  PetscInt i, j, k;
+  for (k = 0; k < zm; k++)
+  {
+    for (j = 0; j < ym; j++)
+    {
+      for (i = 0; i < xm; i++)
+      {
+        PetscInt n = (k * ym + j) * xm + i;
+        PetscScalar pred = REC(i - 1, j, k) + REC(i, j - 1, k) + REC(i, j, k - 1) 
+                         - REC(i - 1, j - 1, k) - REC(i - 1, j, k - 1) - REC(i, j - 1, k - 1) 
+                         + REC(i - 1, j - 1, k - 1);
+        long long q = (eps > 0.f) ? (long long) floor((_u[n] - pred) / (2.f * eps) + 0.5f) : 0;
+        rec[n] = pred + 2.f * eps * q;
+
+        if (!q)
+        {
+          run++;
+          continue;
+        }
+        if (run) PUT_VARINT(2 * run);
+        run = 0;
+        PUT_VARINT(2 * (((unsigned long long) q << 1) ^ (unsigned long long) (q >> 63)) + 1);
+      }
+    }
+  }
+  if (run) PUT_VARINT(2 * run);
+
+#undef PUT_VARINT
+#undef REC
+
+  ierr = VecRestoreArrayRead(u, &_u);   CHKERRQ(ierr);
+  ierr = PetscFree(rec);   CHKERRQ(ierr);
+
+  // Blocks follow the header and the rank table in rank order
+  long long mine = (long long) nbytes, offset = 0, total;
+  MPI_Offset header = (MPI_Offset) (5 * sizeof(int) + sizeof(double) + size * (6 * sizeof(int) + 2 * sizeof(long long)));
+  ierr = MPI_Exscan(&mine, &offset, 1, MPI_LONG_LONG, MPI_SUM, comm);   CHKERRQ(ierr);
+  if (!rank) offset = 0;                            // MPI_Exscan leaves it undefined on the first rank
+  offset += (long long) header;
+  ierr = MPI_Allreduce(&mine, &total, 1, MPI_LONG_LONG, MPI_SUM, comm);   CHKERRQ(ierr);
+
+  int box[6] = {(int) grid.xs, (int) grid.ys, (int) grid.zs, (int) xm, (int) ym, (int) zm}, *boxes = NULL;
+  long long where[2] = {offset, mine}, *wheres = NULL;
+  if (!rank)
+  {
+    ierr = PetscMalloc2(6 * size, &boxes, 2 * size, &wheres);   CHKERRQ(ierr);
+  }
+  ierr = MPI_Gather(box, 6, MPI_INT, boxes, 6, MPI_INT, 0, comm);   CHKERRQ(ierr);
+  ierr = MPI_Gather(where, 2, MPI_LONG_LONG, wheres, 2, MPI_LONG_LONG, 0, comm);   CHKERRQ(ierr);
+
+  snprintf(buffer, sizeof(buffer), "./wavefields/tmp_Bvec_%i.cwf", c->time.it);
+  ierr = MPI_File_open(comm, buffer, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &fh);   CHKERRQ(ierr);
+  ierr = MPI_File_set_size(fh, 0);   CHKERRQ(ierr);
+
+  if (!rank)
+  {
+    int head[5] = {CWF_FILE_MAGIC, (int) size, (int) grid.mx, (int) grid.my, (int) grid.mz};
+    double e = (double) eps;
+    PetscMPIInt r;
+    MPI_Offset pos = 5 * sizeof(int) + sizeof(double);
+
+    swap_bytes(head, sizeof(int), 5);
+    swap_bytes(&e, sizeof(double), 1);
+    swap_bytes(boxes, sizeof(int), 6 * size);
+    swap_bytes(wheres, sizeof(long long), 2 * size);
+    ierr = MPI_File_write_at(fh, 0, head, 5, MPI_INT, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+    ierr = MPI_File_write_at(fh, 5 * sizeof(int), &e, 1, MPI_DOUBLE, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+    for (r = 0; r < size; r++, pos += 6 * sizeof(int) + 2 * sizeof(long long))
+    {
+      ierr = MPI_File_write_at(fh, pos, boxes + 6 * r, 6, MPI_INT, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+      ierr = MPI_File_write_at(fh, pos + 6 * sizeof(int), wheres + 2 * r, 2, MPI_LONG_LONG, 
+                               MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+    }
+    ierr = PetscFree2(boxes, wheres);   CHKERRQ(ierr);
+  }
+  ierr = MPI_File_write_at_all(fh, (MPI_Offset) offset, buf, (int) nbytes, MPI_BYTE, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+  ierr = MPI_File_close(&fh);   CHKERRQ(ierr);
+  ierr = PetscFree(buf);   CHKERRQ(ierr);
+
+  ierr = PetscPrintf(comm, "File created: %s \t ratio %g \n", buffer, 
+                     (double) (grid.mx * grid.my * grid.mz * sizeof(PetscScalar)) / (double) (total + header)); CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// TEST OUTSTANDING SNAPSHOT WRITES, WHICH GIVES THE MPI LIBRARY A CHANCE TO PROGRESS THEM
+PetscErrorCode
+snapshot_async_progress(void * ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  int done;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  PetscInt s;
+  for (s = 0; s < c->out.nslots; s++)
+  {
+    if (c->out.slots[s].busy)
+    {
+      ierr = MPI_Test(&c->out.slots[s].req, &done, MPI_STATUS_IGNORE);   CHKERRQ(ierr);  // The file is closed on reuse
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// COMPLETE AND CLOSE ALL OUTSTANDING SNAPSHOT FILES, OLDEST FIRST
+PetscErrorCode
+snapshot_async_flush(void * ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  PetscInt s;
+  for (s = 0; s < c->out.nslots; s++)
+  {
+    snapshot_slot *slot = &c->out.slots[(c->out.next + s) % c->out.nslots];
+    if (slot->busy)
+    {
+      ierr = MPI_Wait(&slot->req, MPI_STATUS_IGNORE);   CHKERRQ(ierr);   // No-op if MPI_Test completed it
+      ierr = MPI_File_close(&slot->fh);   CHKERRQ(ierr);
+      slot->busy = PETSC_FALSE;
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// SOURCE TERM
+PetscErrorCode
+source_term(void * ctx)
+{
+  PetscFunctionBegin;
+
+  ctx_t *c = (ctx_t *) ctx;
+  source *src = &c->src[c->shot];
+  PetscInt it = c->time.it;
+
+  // The X component of the force is the one applied, its wavelet comes from the table of wavelet_table
+  PetscScalar wavelet = ((it >= 0) && (it <= c->time.nt)) ? c->srcs.wavelet[it] : 0.f;
+  src->fx = src->factor * sin(src->angle_force * DEGREES_TO_RADIANS) * wavelet;
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// SOURCE TIME FUNCTION OF THE STEPS 1 ... nt, AT t = (it - 1) DT, FOR THE CURRENT DT
+// Ricker wavelet (second derivative of a Gaussian) of the -f0 of the shots, or the -wavelet_file samples
+// linearly interpolated, zero after the last one
+PetscErrorCode
+wavelet_table(void *ctx)
+{
+  PetscFunctionBegin;
+
+  ctx_t *c = (ctx_t *) ctx;
+  PetscScalar *f = c->srcs.wavelet;
+  PetscInt it, n = c->srcs.nfile;
+
+  f[0] = 0.f;
+  for (it = 1; it <= c->time.nt; it++)
+  {
+    PetscScalar t = (PetscScalar) (it - 1) * c->time.dt;
+    if (!n)
+    {
+      f[it] = ricker(c->src[0].f0, t);
+      continue;
+    }
+    PetscScalar x = t / c->srcs.file_dt;
+    PetscInt i = (PetscInt) floor(x);
+    if (i + 1 < n)
+    {
+      f[it] = c->srcs.file[i] + (x - i) * (c->srcs.file[i + 1] - c->srcs.file[i]);
+    }
+    else
+    {
+      f[it] = (i == n - 1) ? c->srcs.file[i] : 0.f;
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// POINT SOURCES OF THE CURRENT SHOT, THE OWNED ONES OFF THE BOUNDARY LAYERS AS OFFSETS INTO THE LOCAL BLOCK
+// Injection then costs one update per owned source instead of a test per node. The bounding box of all of
+// them, on every rank, seeds the active region of the explicit scheme
+PetscErrorCode
+source_locate(void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  DMDALocalInfo grid;
+  PetscInt p, a;
+
+  ctx_t *c = (ctx_t *) ctx;
+  source *src = &c->src[c->shot];
+  ierr = DMDAGetLocalInfo(c->solver.da, &grid);   CHKERRQ(ierr);
+
+  PetscInt n[3] = {grid.mx, grid.my, grid.mz};
+  PetscInt s[3] = {grid.xs, grid.ys, grid.zs}, m[3] = {grid.xm, grid.ym, grid.zm};
+  PetscInt *box = c->srcs.box;
+  for (a = 0; a < 3; a++)
+  {
+    box[2 * a] = PETSC_MAX_INT;
+    box[2 * a + 1] = -1;
+  }
+
+  c->srcs.nloc = 0;
+  for (p = 0; p < c->srcs.npts; p++)
+  {
+    PetscInt x[3] = {src->isrc + c->srcs.di[p], src->jsrc + c->srcs.dj[p], src->ksrc + c->srcs.dk[p]};
+    PetscBool inside = PETSC_TRUE, owned = PETSC_TRUE;
+    for (a = 0; a < 3; a++)
+    {
+      inside = (PetscBool) (inside && (x[a] > 0) && (x[a] < n[a] - 1));
+      owned = (PetscBool) (owned && (x[a] >= s[a]) && (x[a] < s[a] + m[a]));
+    }
+    if (!inside) continue;                    // Nothing is injected on the boundary layers
+
+    for (a = 0; a < 3; a++)
+    {
+      box[2 * a] = PetscMin(box[2 * a], x[a]);
+      box[2 * a + 1] = PetscMax(box[2 * a + 1], x[a] + 1);
+    }
+    if (owned)
+    {
+      c->srcs.loc[c->srcs.nloc] = ((x[2] - s[2]) * m[1] + (x[1] - s[1])) * m[0] + (x[0] - s[0]);
+      c->srcs.wloc[c->srcs.nloc] = c->srcs.w[p];
+      c->srcs.nloc++;
+    }
+  }
+  if (box[0] > box[1])
+  {
+    ierr = PetscMemzero(box, 6 * sizeof(PetscInt));   CHKERRQ(ierr);   // Every source is on a boundary layer
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// WHITESPACE-SEPARATED NUMBERS OF A TEXT FILE, READ BY RANK 0 AND BROADCAST
+// *n is the number of rows of ncol numbers, *data holds them row by row and is freed with PetscFree
+PetscErrorCode
+read_text_table(const char *file, PetscInt ncol, PetscInt *n, PetscScalar **data)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscMPIInt rank;
+  PetscInt count = 0, size = 256;
+  PetscScalar *v = NULL;
+  MPI_Comm comm = PETSC_COMM_WORLD;
+
+  ierr = MPI_Comm_rank(comm, &rank);   CHKERRQ(ierr);
+  if (!rank)
+  {
+    double x;
+    FILE *fin = fopen(file, "r");
+    if (fin)
+    {
+      ierr = PetscMalloc1(size, &v);   CHKERRQ(ierr);
+      while (fscanf(fin, "%lf", &x) == 1)
+      {
+        if (count == size)
+        {
+          size *= 2;
+          ierr = PetscRealloc(size * sizeof(PetscScalar), &v);   CHKERRQ(ierr);
+        }
+        v[count++] = (PetscScalar) x;
+      }
+      fclose(fin);
+    }
+    else count = -1;                          // Every rank raises the error after the broadcast
+  }
+  ierr = MPI_Bcast(&count, 1, MPIU_INT, 0, comm);   CHKERRQ(ierr);
+  if (count < 0)
+  {
+    SETERRQ1(comm, PETSC_ERR_FILE_OPEN, "Cannot open %s", file);
+  }
+  if (count % ncol)
+  {
+    SETERRQ2(comm, PETSC_ERR_FILE_UNEXPECTED, "%s must hold %i numbers per line", file, ncol);
+  }
+  if (rank)
+  {
+    ierr = PetscMalloc1(PetscMax(count, 1), &v);   CHKERRQ(ierr);
+  }
+  ierr = MPI_Bcast(v, count, MPIU_SCALAR, 0, comm);   CHKERRQ(ierr);
+
+  *n = count / ncol;
+  *data = v;
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// RICKER WAVELET, a = (PI*f0)^2 AND t0 = 1.2/f0 AS IN THE GAUSSIANS ABOVE
+PetscScalar
+ricker(PetscScalar f0, PetscScalar t)
+{
+  PetscScalar t0 = 1.2f / f0;
+  PetscScalar a = PI*PI*f0*f0;
+
+  return (1.f - 2.f * a * pow(t-t0,2)) * exp(-a*pow(t-t0,2));
+}
+
+
+
+
+
+// UPDATE RHS AT NEW TIME STEP
+PetscErrorCode
+update_b_u(KSP ksp, Vec b, void * ctx) 
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  PetscScalar dt2;
+
+  ctx_t *c = (ctx_t *) ctx;
+  ierr = PetscLogEventBegin(c->log.rhs, 0, 0, 0, 0);   CHKERRQ(ierr);
+  PetscInt it = c->time.it;
+
+  source_term(c);
+  dt2 = pow(c->time.dt,2);
+
+  DM da;
+  ierr = KSPGetDM(ksp, &da);   CHKERRQ(ierr); //Get the DM oject of the KSP
+
+  DMDALocalInfo grid;
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr); //Get the global information of the DM grid
+
+  PetscScalar h3 = c->model.dx * c->model.dy * c->model.dz;
+  
+  PetscScalar *** _b, ***_u = NULL;
+  const PetscScalar *** _um1 = NULL, ***_um2 = NULL, ***_um3 = NULL;
+  const float *f1 = NULL, *f2 = NULL, *f3 = NULL;
+
+  ierr = DMDAVecGetArray(da, b, &_b);   CHKERRQ(ierr);
+  if (c->wf.single)
+  {
+    f1 = WF_HIST(c->wf, it, 1);
+    f2 = WF_HIST(c->wf, it, 2);
+    f3 = WF_HIST(c->wf, it, 3);
+  }
+  else
+  {
+    ierr = DMDAVecGetArrayRead(da, WF_LEVEL(c->wf, it, 1), &_um1);   CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayRead(da, WF_LEVEL(c->wf, it, 2), &_um2);   CHKERRQ(ierr);
+    ierr = DMDAVecGetArrayRead(da, WF_LEVEL(c->wf, it, 3), &_um3);   CHKERRQ(ierr);
+  }
+
+  // The initial guess of the solve, u = p0 um1 + p1 um2 + p2 um3, is written in the same pass over the history
+  const PetscScalar predictor[4][3] = {{0.f, 0.f, 0.f}, {1.f, 0.f, 0.f}, {2.f, -1.f, 0.f}, {3.f, -3.f, 1.f}};
+  const PetscScalar *p = predictor[c->solver.guess_order];
+  if (c->solver.guess_order > 0)
+  {
+    ierr = DMDAVecGetArray(da, WF_LEVEL(c->wf, it, 0), &_u);   CHKERRQ(ierr);
+  }
+
+  // Rows of contiguous i, the boundary layers are split off the interior range so its loop has no branches.
+  // Level n - l of the history is damped by g^l, absorbing the wave in the sponge at no extra pass
+  PetscInt xe = grid.xs + grid.xm;
+  PetscInt i0 = PetscMax(grid.xs, 1), i1 = PetscMin(xe, grid.mx - 1);
+  PetscScalar **g = c->abc.width ? c->abc.g : NULL;
+
+  PetscInt j, k;
+  OMP_FOR_ROWS
+  for(k = grid.zs; k < (grid.zs + grid.zm); k++)      // Depth
+  {
+    for(j = grid.ys; j < (grid.ys + grid.ym); j++)    // Columns
+    {
+      PetscInt i;
+      PetscScalar *restrict br = _b[k][j];
+      const PetscScalar *restrict m1, *restrict m2, *restrict m3;
+      PetscScalar w1[grid.xm], w2[grid.xm], w3[grid.xm];
+
+      // Float rows are widened once into row buffers, so everything below accumulates in double
+      if (f1)
+      {
+        PetscInt off = ((k - grid.zs) * grid.ym + (j - grid.ys)) * grid.xm;
+        for(i = 0; i < grid.xm; i++)
+        {
+          w1[i] = f1[off + i];
+          w2[i] = f2[off + i];
+          w3[i] = f3[off + i];
+        }
+        m1 = w1 - grid.xs;
+        m2 = w2 - grid.xs;
+        m3 = w3 - grid.xs;
+      }
+      else
+      {
+        m1 = _um1[k][j];
+        m2 = _um2[k][j];
+        m3 = _um3[k][j];
+      }
+
+      if (_u)
+      {
+        PetscScalar *restrict ur = _u[k][j];
+        for(i = grid.xs; i < xe; i++)
+        {
+          ur[i] = p[0] * m1[i] + p[1] * m2[i] + p[2] * m3[i];
+        }
+      }
+
+      // Nodes on the boundary layers
+      if((j == 0) || (j == (grid.my - 1)) || (k == 0) || (k == (grid.mz - 1)))
+      {
+        for(i = grid.xs; i < xe; i++)
+        {
+          br[i] = 0.f;
+        }
+        continue;
+      }
+      if (grid.xs == 0)       br[0] = 0.f;
+      if (xe == grid.mx)      br[grid.mx - 1] = 0.f;
+
+      //Interior nodes, h3 * (5 g um1 - 4 g^2 um2 + g^3 um3)
+      if (g)
+      {
+        PetscScalar gjk = g[1][j] * g[2][k];
+        const PetscScalar *restrict gx = g[0];
+        for(i = i0; i < i1; i++)
+        {
+          PetscScalar gi = gx[i] * gjk;
+          br[i] = h3 * gi * (5.f * m1[i] + gi * (-4.f * m2[i] + gi * m3[i]));
+        }
+      }
+      else
+      {
+        for(i = i0; i < i1; i++)
+        {
+          br[i] = h3 * (5.f * m1[i] - 4.f * m2[i] + m3[i]);
+        }
+      }
+    }
+  }
+
+  // Point sources, added after the sweep at their offsets in the owned block
+  PetscScalar *b0 = &_b[grid.zs][grid.ys][grid.xs], force = h3 * dt2 * c->src[c->shot].fx;
+  PetscInt q;
+  for (q = 0; q < c->srcs.nloc; q++)
+  {
+    b0[c->srcs.loc[q]] += force * c->srcs.wloc[q];
+  }
+
+  ierr = DMDAVecRestoreArray(da, b, &_b);             CHKERRQ(ierr);   // Release the resource
+  if (!c->wf.single)
+  {
+    ierr = DMDAVecRestoreArrayRead(da, WF_LEVEL(c->wf, it, 1), &_um1);   CHKERRQ(ierr);   // Release the resource
+    ierr = DMDAVecRestoreArrayRead(da, WF_LEVEL(c->wf, it, 2), &_um2);   CHKERRQ(ierr);   // Release the resource
+    ierr = DMDAVecRestoreArrayRead(da, WF_LEVEL(c->wf, it, 3), &_um3);   CHKERRQ(ierr);   // Release the resource
+  }
+  if (_u)
+  {
+    ierr = DMDAVecRestoreArray(da, WF_LEVEL(c->wf, it, 0), &_u);   CHKERRQ(ierr);
+  }
+
+  ierr = PetscLogEventEnd(c->log.rhs, 0, 0, 0, 0);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// UPDATE RHS WITH VEC OPERATIONS ONLY, SAME b AND INITIAL GUESS AS update_b_u
+// Nothing here reads a host array, so with device Vecs the history never leaves the device
+PetscErrorCode
+update_b_vec(KSP ksp, Vec b, void * ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+
+  ctx_t *c = (ctx_t *) ctx;
+  ierr = PetscLogEventBegin(c->log.rhs, 0, 0, 0, 0);   CHKERRQ(ierr);
+  PetscInt it = c->time.it;
+
+  source_term(c);
+  PetscScalar dt2 = pow(c->time.dt, 2);
+  PetscScalar h3 = c->model.dx * c->model.dy * c->model.dz;
+
+  Vec hist[3] = {WF_LEVEL(c->wf, it, 1), WF_LEVEL(c->wf, it, 2), WF_LEVEL(c->wf, it, 3)};
+
+  // Interior nodes h3 * (5 g um1 - 4 g^2 um2 + g^3 um3), the masks already hold zero on the boundary layers
+  if (c->dev.g[0])
+  {
+    ierr = VecPointwiseMult(b, c->dev.g[0], hist[0]);   CHKERRQ(ierr);
+    ierr = VecScale(b, 5.f);   CHKERRQ(ierr);
+    ierr = VecPointwiseMult(c->dev.work, c->dev.g[1], hist[1]);   CHKERRQ(ierr);
+    ierr = VecAXPY(b, -4.f, c->dev.work);   CHKERRQ(ierr);
+    ierr = VecPointwiseMult(c->dev.work, c->dev.g[2], hist[2]);   CHKERRQ(ierr);
+    ierr = VecAXPY(b, 1.f, c->dev.work);   CHKERRQ(ierr);
+  }
+  else
+  {
+    ierr = VecCopy(hist[2], b);   CHKERRQ(ierr);
+    ierr = VecAXPBYPCZ(b, 5.f, -4.f, 1.f, hist[0], hist[1]);   CHKERRQ(ierr);
+    ierr = VecPointwiseMult(b, b, c->dev.interior);   CHKERRQ(ierr);
+  }
+  ierr = VecScale(b, h3);   CHKERRQ(ierr);
+
+  // Point sources, delta holds their weights and is zero on the boundary layers
+  ierr = VecAXPY(b, h3 * dt2 * c->src[c->shot].fx, c->dev.delta);   CHKERRQ(ierr);
+
+  // Initial guess of the solve, u = p0 um1 + p1 um2 + p2 um3
+  const PetscScalar predictor[4][3] = {{0.f, 0.f, 0.f}, {1.f, 0.f, 0.f}, {2.f, -1.f, 0.f}, {3.f, -3.f, 1.f}};
+  if (c->solver.guess_order > 0)
+  {
+    Vec u = WF_LEVEL(c->wf, it, 0);
+    ierr = VecZeroEntries(u);   CHKERRQ(ierr);
+    ierr = VecMAXPY(u, c->solver.guess_order, predictor[c->solver.guess_order], hist);   CHKERRQ(ierr);
+  }
+
+  ierr = PetscLogEventEnd(c->log.rhs, 0, 0, 0, 0);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// BUILD MATRIX A, ON THE FINE MESH OR ON ANY LEVEL OF THE PCMG HIERARCHY
+PetscErrorCode 
+compute_A_u(KSP ksp, Mat A, Mat J, void * ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscScalar v[1 + 6 * STENCIL_MAX_RADIUS], hx, hy, hz, hw[3];
+  PetscScalar dt, dt2;
+  PetscScalar vel, vel2;  
+  const PetscScalar ***_c2 = NULL;
+  Vec vel2_level;
+  PetscInt n;
+  DM da;
+  DMDALocalInfo grid;
+  MatStencil idxm;  //A PETSc data structure to store information about a single row or column in the stencil
+  MatStencil idxn[1 + 6 * STENCIL_MAX_RADIUS];
+  
+  ctx_t *c = (ctx_t *) ctx;
+  const PetscScalar *d = c->stencil.d;
+  PetscInt R = c->stencil.radius;
+
+  ierr = KSPGetDM(ksp, &da);   CHKERRQ(ierr);             // Get the DMDA object, a coarse one on PCMG levels
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);    // Get the grid information
+
+  ierr = velocity_on_level(da, ctx, &vel2_level);   CHKERRQ(ierr);
+  if (vel2_level)
+  {
+    ierr = DMDAVecGetArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+
+  vel = c->model.vel;
+  vel2 = pow(vel, 2);
+
+  dt = c->time.dt;
+  dt2 = dt * dt;
+
+  // Grid spacing of this level, the same as model.dx, dy, dz on the finest one
+  hx = c->model.xmax / grid.mx;
+  hy = c->model.ymax / grid.my;
+  hz = c->model.zmax / grid.mz;
+
+  hw[0] = hy * hz / hx;
+  hw[1] = hx * hz / hy;
+  hw[2] = hx * hy / hz;
+
+  /* Loop over the grid points */
+  PetscInt k;
+  for(k = grid.zs; k < (grid.zs + grid.zm); k++)          // Depth 
+  {
+    PetscInt j;
+    for(j = grid.ys; j < (grid.ys + grid.ym); j++)        // Columns 
+    {
+      PetscInt i;
+      for(i = grid.xs; i < (grid.xs + grid.xm); i++)      // Rows
+      { 
+        n = 1;
+        idxm.k = k;
+        idxm.j = j;
+        idxm.i = i;
+        
+        idxn[0].k = k;
+        idxn[0].j = j;
+        idxn[0].i = i;
+
+        // Nodes on the boundary layers
+        if((i == 0) || (i == (grid.mx - 1)) ||
+          (j == 0) || (j == (grid.my - 1)) ||
+          (k == 0) || (k == (grid.mz - 1)))
+        {
+          v[0]=1.f;
+        }
+        // Interior nodes
+        else 
+        {
+          if (_c2) vel2 = _c2[k][j][i];  // Each row is scaled by the squared velocity of its node
+          v[0] = - d[0] * vel2 * dt2 * (hw[0] + hw[1] + hw[2]);
+
+          // If the farthest tap on one side of the axis is not a known boundary value
+          // then we put an entry for every tap on that side
+          PetscInt pos[3] = {i, j, k};
+          PetscInt size[3] = {grid.mx, grid.my, grid.mz};
+          PetscInt a, side, m;
+          for (a = 0; a < 3; a++)
+          {
+            for (side = -1; side <= 1; side += 2)
+            {
+              if (((pos[a] + side * R) <= 0) || ((pos[a] + side * R) >= (size[a] - 1))) continue;
+
+              for (m = 1; m <= R; m++)
+              {
+                idxn[n] = idxm;                                     // Get the column indices
+                if (a == 0) idxn[n].i += side * m;
+                if (a == 1) idxn[n].j += side * m;
+                if (a == 2) idxn[n].k += side * m;
+
+                v[n] = - d[m] * vel2 * dt2 * hw[a];                 // Fill with the value
+                n++;                                                // One column added
+              }
+            }
+          }
+      
+          v[0]+= 2.f * hx * hy * hz;
+        }
+      
+      // Insert one row of the matrix A
+      ierr = MatSetValuesStencil(A, 1, (const MatStencil *) &idxm, 
+                                (PetscInt) n, (const MatStencil *) &idxn,
+                                (PetscScalar *) v, INSERT_VALUES);       CHKERRQ(ierr);
+      }
+    }
+  }
+  
+  if (vel2_level)
+  {
+    ierr = DMDAVecRestoreArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+
+  /* Assemble the matrix */
+  ierr = MatAssemblyBegin(A, MAT_FINAL_ASSEMBLY);   CHKERRQ(ierr);
+  ierr = MatAssemblyEnd(A ,MAT_FINAL_ASSEMBLY);   CHKERRQ(ierr);
+
+  // Null space built once in main(), KSPSolve removes it from b
+  if (c->solver.nullspace)
+  {
+    ierr = MatSetNullSpace(A, c->solver.nullspace);   CHKERRQ(ierr);
+    ierr = MatSetTransposeNullSpace(A, c->solver.nullspace);   CHKERRQ(ierr);
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+
+
+// MATRIX-FREE y = A x, SAME STENCIL AS compute_A_u
+PetscErrorCode
+apply_A_u(Mat A, Vec x, Vec y)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscScalar hx, hy, hz, w[3], h3;
+  PetscScalar dt, dt2;
+  PetscScalar vel, vel2;
+  const PetscScalar ***_x, ***_c2 = NULL;
+  Vec vel2_level;
+  PetscScalar ***_y;
+  Vec xloc;
+  DM da;
+  DMDALocalInfo grid;
+  ctx_t *c;
+
+  ierr = MatShellGetContext(A, &c);   CHKERRQ(ierr);
+  da = c->solver.da;
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);    // Get the grid information
+
+  vel = c->model.vel;
+  vel2 = pow(vel, 2);
+
+  dt = c->time.dt;
+  dt2 = dt * dt;
+
+  hx = c->model.dx;
+  hy = c->model.dy;
+  hz = c->model.dz;
+
+  w[0] = dt2 * hy * hz / hx;                              // Stencil weights as in compute_A_u, vel2 is applied per node
+  w[1] = dt2 * hx * hz / hy;
+  w[2] = dt2 * hx * hy / hz;
+  h3 = 2.f * hx * hy * hz;
+
+  ierr = velocity_on_level(da, c, &vel2_level);   CHKERRQ(ierr);
+  if (vel2_level)
+  {
+    ierr = DMDAVecGetArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+
+  // Ghosted copy of x, the stencil width of the DMDA is the radius of the stencil
+  ierr = DMGetLocalVector(da, &xloc);   CHKERRQ(ierr);
+  ierr = DMGlobalToLocalBegin(da, x, INSERT_VALUES, xloc);   CHKERRQ(ierr);
+  ierr = DMGlobalToLocalEnd(da, x, INSERT_VALUES, xloc);   CHKERRQ(ierr);
+
+  ierr = DMDAVecGetArrayRead(da, xloc, &_x);   CHKERRQ(ierr);
+  ierr = DMDAVecGetArray(da, y, &_y);   CHKERRQ(ierr);
+
+  ierr = c->stencil.apply_box(&grid, w, h3, vel2, _c2, _x, _y);   CHKERRQ(ierr);
+
+  ierr = DMDAVecRestoreArrayRead(da, xloc, &_x);   CHKERRQ(ierr);   // Release the resource
+  ierr = DMDAVecRestoreArray(da, y, &_y);   CHKERRQ(ierr);          // Release the resource
+  if (vel2_level)
+  {
+    ierr = DMDAVecRestoreArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+  ierr = DMRestoreLocalVector(da, &xloc);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// DIAGONAL OF THE MATRIX-FREE A, USED BY -pc_type jacobi
+PetscErrorCode
+diag_A_u(Mat A, Vec d)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscScalar hx, hy, hz, dt2, vel2, w0, h3;
+  PetscScalar ***_d;
+  const PetscScalar ***_c2 = NULL;
+  Vec vel2_level;
+  DM da;
+  DMDALocalInfo grid;
+  ctx_t *c;
+
+  ierr = MatShellGetContext(A, &c);   CHKERRQ(ierr);
+  da = c->solver.da;
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);
+
+  vel2 = pow(c->model.vel, 2);
+  dt2 = c->time.dt * c->time.dt;
+
+  hx = c->model.dx;
+  hy = c->model.dy;
+  hz = c->model.dz;
+
+  w0 = - c->stencil.d[0] * dt2 * (hy * hz / hx + hx * hz / hy + hx * hy / hz);
+  h3 = 2.f * hx * hy * hz;
+
+  ierr = DMDAVecGetArray(da, d, &_d);   CHKERRQ(ierr);
+  ierr = velocity_on_level(da, c, &vel2_level);   CHKERRQ(ierr);
+  if (vel2_level)
+  {
+    ierr = DMDAVecGetArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+
+  PetscInt k;
+  for(k = grid.zs; k < (grid.zs + grid.zm); k++)          // Depth 
+  {
+    PetscInt j;
+    for(j = grid.ys; j < (grid.ys + grid.ym); j++)        // Columns 
+    {
+      PetscInt i;
+      for(i = grid.xs; i < (grid.xs + grid.xm); i++)      // Rows
+      {
+        if((i == 0) || (i == (grid.mx - 1)) ||
+          (j == 0) || (j == (grid.my - 1)) ||
+          (k == 0) || (k == (grid.mz - 1)))
+        {
+          _d[k][j][i] = 1.f;
+        }
+        else
+        {
+          _d[k][j][i] = (_c2 ? _c2[k][j][i] : vel2) * w0 + h3;
+        }
+      }
+    }
+  }
+
+  ierr = DMDAVecRestoreArray(da, d, &_d);   CHKERRQ(ierr);
+  if (vel2_level)
+  {
+    ierr = DMDAVecRestoreArrayRead(da, vel2_level, &_c2);   CHKERRQ(ierr);
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+
+
+
+
+// TAKE THE NEXT SHOT FROM THE QUEUE, c->shot >= c->nshots WHEN THE SURVEY IS DONE
+// The first rank of the group fetches and increments the counter of world rank 0, the group follows it
+PetscErrorCode
+next_shot(void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscMPIInt rank, one = 1, shot = 0;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  ierr = MPI_Comm_rank(PETSC_COMM_WORLD, &rank);   CHKERRQ(ierr);
+  if (!rank)
+  {
+    ierr = MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, c->queue.win);   CHKERRQ(ierr);
+    ierr = MPI_Fetch_and_op(&one, &shot, MPI_INT, 0, 0, MPI_SUM, c->queue.win);   CHKERRQ(ierr);
+    ierr = MPI_Win_unlock(0, c->queue.win);   CHKERRQ(ierr);
+  }
+  ierr = MPI_Bcast(&shot, 1, MPI_INT, 0, PETSC_COMM_WORLD);   CHKERRQ(ierr);
+
+  c->shot = (PetscInt) shot;
+
+  PetscFunctionReturn(0);
+}
+
+
+
+
+
+
+
+// DAMPING PROFILES OF THE ABSORBING LAYER, CERJAN ET AL. (1985)
+// g = exp(-(ABC_DAMPING * (width - d) / width)^2) for the nodes d < width away from the first interior node
+PetscErrorCode
+build_sponge(void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  PetscInt n[3] = {c->model.nx, c->model.ny, c->model.nz};
+  PetscInt width = c->abc.width;
+  PetscInt a, i, d;
+
+  c->abc.g[0] = c->abc.g[1] = c->abc.g[2] = NULL;
+  if (width < 0)
+  {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE, "-abc_width must not be negative");
+  }
+  if (!width) PetscFunctionReturn(0);
+  if (2 * width + 2 >= PetscMin(n[0], PetscMin(n[1], n[2])))
+  {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE, "-abc_width leaves no interior to the model");
+  }
+
+  ierr = PetscMalloc3(n[0], &c->abc.g[0], n[1], &c->abc.g[1], n[2], &c->abc.g[2]);   CHKERRQ(ierr);
+  for (a = 0; a < 3; a++)
+  {
+    for (i = 0; i < n[a]; i++)
+    {
+      d = PetscMin(i, n[a] - 1 - i) - 1;      // -1 on the Dirichlet nodes, which stay at zero anyway
+      c->abc.g[a][i] = (d < width) ? exp(-pow(ABC_DAMPING * (width - d) / width, 2)) : 1.f;
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+
+
+
+
+// SQUARED VELOCITY ON THE LEVEL OF da, NULL FOR THE HOMOGENEOUS MODEL
+// Coarse PCMG levels get the model injected from the fine grid once, the Vec is then kept on their DM
+PetscErrorCode
+velocity_on_level(DM da, void *ctx, Vec *vel2)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  Mat inject;
+  Vec vc;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  *vel2 = NULL;
+  if (!c->model.vel2) PetscFunctionReturn(0);
+
+  if (da == c->solver.da)
+  {
+    *vel2 = c->model.vel2;
+    PetscFunctionReturn(0);
+  }
+
+  ierr = PetscObjectQuery((PetscObject) da, "vel2", (PetscObject *) vel2);   CHKERRQ(ierr);
+  if (*vel2) PetscFunctionReturn(0);
+
+  ierr = DMCreateGlobalVector(da, &vc);   CHKERRQ(ierr);
+  ierr = DMCreateInjection(da, c->solver.da, &inject);   CHKERRQ(ierr);
+  ierr = MatRestrict(inject, c->model.vel2, vc);   CHKERRQ(ierr);
+  ierr = MatDestroy(&inject);   CHKERRQ(ierr);
+
+  ierr = PetscObjectCompose((PetscObject) da, "vel2", (PetscObject) vc);   CHKERRQ(ierr);
+  *vel2 = vc;
+  ierr = VecDestroy(&vc);   CHKERRQ(ierr);                  // The DM holds the remaining reference
+
+  PetscFunctionReturn(0);
+}
+
+
+
+
+
+
+
+// FIND THE RECEIVERS OWNED BY THIS RANK AND ALLOCATE THEIR TRACES
+PetscErrorCode
+locate_receivers(DM da, void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  DMDALocalInfo grid;
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);  //Get the global information of the DM grid
+
+  PetscInt nrec = c->rec.nrec;
+  PetscInt *irec = c->rec.irec;
+  PetscInt *jrec = c->rec.jrec;
+  PetscInt *krec = c->rec.krec;
+
+  // Ownership ranges are half-open, so a receiver on a subdomain edge has exactly one owner.
+  // Count first, then store the global index and the local offset of the owned receivers
+  PetscInt xrec, nloc = 0;
+  PetscInt pass;
+  for (pass = 0; pass < 2; pass++)
+  {
+    if (pass == 1)
+    {
+      ierr = PetscMalloc2(nloc, &c->rec.id, nloc, &c->rec.loc);   CHKERRQ(ierr);
+      nloc = 0;
+    }
+    for (xrec = 0; xrec < nrec; xrec++)
+    {
+      if ((irec[xrec] >= grid.xs) && (irec[xrec] < (grid.xs + grid.xm)) &&
+          (jrec[xrec] >= grid.ys) && (jrec[xrec] < (grid.ys + grid.ym)) &&
+          (krec[xrec] >= grid.zs) && (krec[xrec] < (grid.zs + grid.zm)))
+      {
+        if (pass == 1)
+        {
+          c->rec.id[nloc] = xrec;
+          c->rec.loc[nloc] = ((krec[xrec] - grid.zs) * grid.ym + (jrec[xrec] - grid.ys)) * grid.xm 
+                             + (irec[xrec] - grid.xs);
+        }
+        nloc++;
+      }
+    }
+  }
+  c->rec.nloc = nloc;
+
+  // Receivers outside of the grid are not recorded by anyone
+  PetscInt nown;
+  ierr = MPI_Allreduce(&nloc, &nown, 1, MPIU_INT, MPI_SUM, PETSC_COMM_WORLD);   CHKERRQ(ierr);
+  if (nown < nrec)
+  {
+    ierr = PetscPrintf(PETSC_COMM_WORLD, 
+                       "WARNING: %i receivers lie outside of the grid and are not recorded \n", nrec - nown); CHKERRQ(ierr);
+  }
+
+  // One contiguous trace of nbuf samples per owned receiver
+  ierr = PetscCalloc1(nloc * c->rec.nbuf, &c->rec.trace);   CHKERRQ(ierr);
+  ierr = PetscMalloc3(nloc, &c->rec.dist, nloc, &c->rec.amp, nloc, &c->rec.tvalid);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// WRITE DOWN FILES WITH SEISMOGRAMS
+PetscErrorCode
+Save_seismograms_to_txt_files(KSP ksp, void *ctx) 
+{
+  PetscFunctionBegin;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  PetscInt nt = c->time.nt;
+  PetscInt nbuf = c->rec.nbuf;
+  PetscScalar dt = c->time.dt;
+
+  // Each rank writes the traces it owns, no gather of the seismograms is needed
+  PetscInt r, xrec;
+  for (r = 0; r < c->rec.nloc; r++)
+  {
+    xrec = c->rec.id[r];
+
+    char buffer[96];
+    if (c->nshots > 1)      // One set of files per shot
+    {
+      snprintf(buffer, sizeof(buffer), "./seism/seis_shot%i_%i_%i_%i_%i_%i_%i.txt", c->shot,
+      xrec, c->rec.irec[xrec], c->rec.jrec[xrec], c->rec.krec[xrec], (int) c->src[c->shot].f0, (int) c-> model.xmax);
+    }
+    else
+    {
+      snprintf(buffer, sizeof(buffer), "./seism/seis_%i_%i_%i_%i_%i_%i.txt", 
+      xrec, c->rec.irec[xrec], c->rec.jrec[xrec], c->rec.krec[xrec], (int) c->src[c->shot].f0, (int) c-> model.xmax);
+    }
+
+    FILE *fout = fopen(buffer, "wb");     
+    if (!fout) SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_FILE_OPEN, "Cannot open %s", buffer);
+
+    PetscScalar *trace = c->rec.trace + r * nbuf;   // Time is implicit, t = i*dt
+    int i;
+    for (i = 0; i < nt ; i++)
+    {
+      fprintf(fout, "%f \t %f \n", i * dt, trace[i]);
+    }            
+    fclose(fout); 
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// CREATE THE SHARED BINARY SEISMOGRAM FILE AND WRITE ITS HEADER
+// Layout, big-endian: int32 magic, nrec, nt, steps written; float64 dt;
+// int32 irec[nrec], jrec[nrec], krec[nrec]; float32 samples [nt][nrec]
+PetscErrorCode
+seis_file_open(void *ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  PetscMPIInt rank;
+  MPI_Datatype column;
+
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt nrec = c->rec.nrec;
+  PetscInt nloc = c->rec.nloc;
+
+  c->rec.header = (MPI_Offset) (4 * sizeof(int) + sizeof(double) + 3 * nrec * sizeof(int));
+
+  char buffer[64];
+  if (c->nshots > 1) snprintf(buffer, sizeof(buffer), "./seism/seis_shot%i.bin", c->shot);
+  else               snprintf(buffer, sizeof(buffer), "./seism/seis.bin");
+
+  ierr = MPI_File_open(PETSC_COMM_WORLD, buffer, MPI_MODE_WRONLY | MPI_MODE_CREATE, 
+                       MPI_INFO_NULL, &c->rec.fh);   CHKERRQ(ierr);
+  if (!c->time.it0)
+  {
+    ierr = MPI_File_set_size(c->rec.fh, 0);   CHKERRQ(ierr);    // A resumed shot keeps the chunks written before
+  }
+
+  ierr = MPI_Comm_rank(PETSC_COMM_WORLD, &rank);   CHKERRQ(ierr);
+  if (!rank)
+  {
+    int head[4] = {SEIS_FILE_MAGIC, (int) nrec, (int) c->time.nt, 0};
+    double dt = (double) c->time.dt;
+    int *pos;
+    PetscInt i;
+
+    ierr = PetscMalloc1(3 * nrec, &pos);   CHKERRQ(ierr);
+    for (i = 0; i < nrec; i++)
+    {
+      pos[i]            = (int) c->rec.irec[i];
+      pos[nrec + i]     = (int) c->rec.jrec[i];
+      pos[2 * nrec + i] = (int) c->rec.krec[i];
+    }
+    swap_bytes(head, sizeof(int), 4);
+    swap_bytes(&dt, sizeof(double), 1);
+    swap_bytes(pos, sizeof(int), 3 * nrec);
+
+    ierr = MPI_File_write_at(c->rec.fh, 0, head, 4, MPI_INT, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+    ierr = MPI_File_write_at(c->rec.fh, 4 * sizeof(int), &dt, 1, MPI_DOUBLE, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+    ierr = MPI_File_write_at(c->rec.fh, 4 * sizeof(int) + sizeof(double), pos, 3 * (int) nrec, MPI_INT, 
+                             MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+    ierr = PetscFree(pos);   CHKERRQ(ierr);
+  }
+
+  // One time step of the file is a row of nrec samples, a rank owns the columns of its receivers.
+  // The type is resized to the full row so that consecutive steps tile the file view
+  int *cols;
+  ierr = PetscMalloc1(nloc, &cols);   CHKERRQ(ierr);
+  PetscInt r;
+  for (r = 0; r < nloc; r++) cols[r] = (int) c->rec.id[r];
+  ierr = MPI_Type_create_indexed_block((int) nloc, 1, cols, MPI_FLOAT, &column);   CHKERRQ(ierr);
+  ierr = MPI_Type_create_resized(column, 0, (MPI_Aint) (nrec * sizeof(float)), &c->rec.ftype);   CHKERRQ(ierr);
+  ierr = MPI_Type_commit(&c->rec.ftype);   CHKERRQ(ierr);
+  ierr = MPI_Type_free(&column);   CHKERRQ(ierr);
+  ierr = PetscFree(cols);   CHKERRQ(ierr);
+
+  ierr = PetscMalloc1(nloc * c->rec.nbuf, &c->rec.stage);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// WRITE THE BUFFERED CHUNK OF SAMPLES, ALL RANKS TOGETHER, AND UPDATE THE STEP COUNT OF THE HEADER
+PetscErrorCode
+seis_file_flush(void *ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+  PetscMPIInt rank;
+
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt it = c->time.it;
+  PetscInt nrec = c->rec.nrec;
+  PetscInt nloc = c->rec.nloc;
+  PetscInt nbuf = c->rec.nbuf;
+  PetscInt ncur = (it - 1) % nbuf + 1;    // Samples in this chunk, the last one may be short
+  PetscInt it0 = it - ncur;               // First step of the chunk, from 0
+
+  // Receiver-major doubles to time-major float32, as laid out in the file
+  PetscInt r, s;
+  for (s = 0; s < ncur; s++)
+  {
+    for (r = 0; r < nloc; r++)
+    {
+      c->rec.stage[s * nloc + r] = (float) c->rec.trace[r * nbuf + s];
+    }
+  }
+  swap_bytes(c->rec.stage, sizeof(float), nloc * ncur);
+
+  MPI_Offset disp = c->rec.header + (MPI_Offset) it0 * nrec * sizeof(float);
+  ierr = MPI_File_set_view(c->rec.fh, disp, MPI_FLOAT, c->rec.ftype, "native", MPI_INFO_NULL);   CHKERRQ(ierr);
+  ierr = MPI_File_write_all(c->rec.fh, c->rec.stage, (int) (nloc * ncur), MPI_FLOAT, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+
+  // The step count tells a reader how much of the file is valid if the run dies before the end
+  ierr = MPI_File_set_view(c->rec.fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);   CHKERRQ(ierr);
+  ierr = MPI_Comm_rank(PETSC_COMM_WORLD, &rank);   CHKERRQ(ierr);
+  if (!rank)
+  {
+    int nwritten = (int) it;
+    swap_bytes(&nwritten, sizeof(int), 1);
+    ierr = MPI_File_write_at(c->rec.fh, 3 * sizeof(int), &nwritten, 1, MPI_INT, MPI_STATUS_IGNORE);   CHKERRQ(ierr);
+  }
+  ierr = MPI_File_sync(c->rec.fh);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// CLOSE THE SHARED BINARY SEISMOGRAM FILE
+PetscErrorCode
+seis_file_close(void *ctx)
+{
+  PetscFunctionBegin;
+  PetscErrorCode ierr;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  ierr = MPI_File_close(&c->rec.fh);   CHKERRQ(ierr);
+  ierr = MPI_Type_free(&c->rec.ftype);   CHKERRQ(ierr);
+  ierr = PetscFree(c->rec.stage);   CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "Seismograms of shot %i written \n", c->shot); CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// ANALYTIC SOLUTION AT THE OWNED RECEIVERS FOR THE CURRENT SHOT, AND WHEN IT STOPS BEING VALID
+PetscErrorCode
+accuracy_setup(void *ctx)
+{
+  PetscFunctionBegin;
+
+  ctx_t *c = (ctx_t *) ctx;
+  source *src = &c->src[c->shot];
+
+  // The source term s(t) of a node is a point force of strength h^3 s(t), and in a homogeneous
+  // medium u = h^3 s(t - r/c) / (4 PI c^2 r). It holds until the first wave reflected by the 
+  // Dirichlet planes at 0 and n-1 arrives, i.e. over the distance to the nearest mirror source
+  PetscScalar h[3] = {c->model.dx, c->model.dy, c->model.dz};
+  PetscInt n[3] = {c->model.nx, c->model.ny, c->model.nz};
+  PetscInt xs[3] = {src->isrc, src->jsrc, src->ksrc};
+  PetscScalar vel = c->model.vel;
+  PetscScalar s = src->factor * sin(src->angle_force * DEGREES_TO_RADIANS);
+
+  PetscInt r, d;
+  for (r = 0; r < c->rec.nloc; r++)
+  {
+    PetscInt id = c->rec.id[r];
+    PetscInt xr[3] = {c->rec.irec[id], c->rec.jrec[id], c->rec.krec[id]};
+    PetscReal dist2 = 0.f, image2 = PETSC_MAX_REAL;
+
+    for (d = 0; d < 3; d++)
+    {
+      dist2 += pow((xr[d] - xs[d]) * h[d], 2);
+    }
+    for (d = 0; d < 3; d++)
+    {
+      PetscReal along = pow((xr[d] - xs[d]) * h[d], 2);
+      image2 = PetscMin(image2, dist2 - along + pow((xr[d] + xs[d]) * h[d], 2));
+      image2 = PetscMin(image2, dist2 - along + pow((2 * (n[d] - 1) - xr[d] - xs[d]) * h[d], 2));
+    }
+
+    c->rec.dist[r] = sqrt(dist2);
+    if (dist2 > 0.f)
+    {
+      c->rec.amp[r] = h[0] * h[1] * h[2] * s / (4.f * PI * vel * vel * c->rec.dist[r]);
+      c->rec.tvalid[r] = sqrt(image2) / vel;
+    }
+    else
+    {
+      c->rec.amp[r] = 0.f;                    // Singular at the source, never compared
+      c->rec.tvalid[r] = 0.f;
+    }
+  }
+
+  c->rec.misfit[0] = 0.f;
+  c->rec.misfit[1] = 0.f;
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// RELATIVE L2 MISFIT OF ALL TRACES TO THE ANALYTIC SOLUTION, OVER THE SAMPLES BEFORE THE FIRST REFLECTION
+PetscErrorCode
+accuracy_report(void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  PetscReal sums[2];
+  ierr = MPI_Allreduce(c->rec.misfit, sums, 2, MPIU_REAL, MPI_SUM, PETSC_COMM_WORLD);   CHKERRQ(ierr);
+
+  if (sums[1] > 0.f)
+  {
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "ACCURACY: \t shot %i \t relative L2 misfit to the analytic solution \t %g \n\n", 
+                       c->shot, (double) sqrt(sums[0] / sums[1])); CHKERRQ(ierr);
+  }
+  else
+  {
+    ierr = PetscPrintf(PETSC_COMM_WORLD, 
+                       "WARNING: no receiver recorded the direct wave of shot %i before the first reflection \n\n", 
+                       c->shot); CHKERRQ(ierr);
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// FIRST-TOUCH PLACEMENT, THE ARRAY OF v IS REPLACED BY ONE FIRST WRITTEN BY THE THREADS THAT WILL WORK ON IT
+// Pages go to the NUMA node of the thread that touches them first, and PETSc zeroes a new Vec from one thread
+PetscErrorCode
+first_touch(DM da, Vec v)
+{
+  PetscFunctionBegin;
+
+#if defined(_OPENMP)
+  PetscErrorCode ierr;
+  PetscScalar *array;
+  PetscInt nloc;
+  DMDALocalInfo grid;
+  PetscBool host_vec;
+
+  // A device Vec keeps its own allocation
+  ierr = PetscObjectTypeCompareAny((PetscObject) v, &host_vec, VECSEQ, VECMPI, "");   CHKERRQ(ierr);
+  if (!host_vec) PetscFunctionReturn(0);
+
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);
+  ierr = VecGetLocalSize(v, &nloc);   CHKERRQ(ierr);
+  ierr = PetscMalloc1(nloc, &array);   CHKERRQ(ierr);
+
+  PetscInt j, k;
+  OMP_FOR_ROWS
+  for(k = 0; k < grid.zm; k++)      // Depth
+  {
+    for(j = 0; j < grid.ym; j++)    // Columns
+    {
+      PetscScalar *row = array + (k * grid.ym + j) * grid.xm;
+      PetscInt i;
+      for(i = 0; i < grid.xm; i++)
+      {
+        row[i] = 0.f;
+      }
+    }
+  }
+
+  ierr = VecReplaceArray(v, array);   CHKERRQ(ierr);      // v frees it with PetscFree
+#endif
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// VECTORS OF THE DEVICE PATH: MASKS OF THE INTERIOR AND OF THE SPONGE, AND THE GATHER OF THE RECEIVERS
+// They are filled once on the host, the time loop only uses them through Vec operations
+PetscErrorCode
+device_setup(DM da, void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscScalar ***_m, ***_g[3];
+  DMDALocalInfo grid;
+  IS from, to;
+  PetscInt l;
+
+  ctx_t *c = (ctx_t *) ctx;
+  ierr = DMDAGetLocalInfo(da, &grid);   CHKERRQ(ierr);
+
+  ierr = DMCreateGlobalVector(da, &c->dev.interior);   CHKERRQ(ierr);
+  ierr = VecDuplicate(c->dev.interior, &c->dev.delta);   CHKERRQ(ierr);
+  ierr = VecDuplicate(c->dev.interior, &c->dev.work);   CHKERRQ(ierr);
+  for (l = 0; l < 3; l++)
+  {
+    c->dev.g[l] = NULL;
+    if (c->abc.width)
+    {
+      ierr = VecDuplicate(c->dev.interior, &c->dev.g[l]);   CHKERRQ(ierr);
+      ierr = DMDAVecGetArray(da, c->dev.g[l], &_g[l]);   CHKERRQ(ierr);
+    }
+  }
+  ierr = DMDAVecGetArray(da, c->dev.interior, &_m);   CHKERRQ(ierr);
+
+  PetscInt i, j, k;
+  for(k = grid.zs; k < (grid.zs + grid.zm); k++)          // Depth
+  {
+    for(j = grid.ys; j < (grid.ys + grid.ym); j++)        // Columns
+    {
+      for(i = grid.xs; i < (grid.xs + grid.xm); i++)      // Rows
+      {
+        PetscScalar mask = ((i == 0) || (i == (grid.mx - 1)) ||
+                            (j == 0) || (j == (grid.my - 1)) ||
+                            (k == 0) || (k == (grid.mz - 1))) ? 0.f : 1.f;
+        _m[k][j][i] = mask;
+        if (c->abc.width)
+        {
+          PetscScalar gi = c->abc.g[0][i] * c->abc.g[1][j] * c->abc.g[2][k];
+          _g[0][k][j][i] = mask * gi;
+          _g[1][k][j][i] = mask * gi * gi;
+          _g[2][k][j][i] = mask * gi * gi * gi;
+        }
+      }
+    }
+  }
+
+  ierr = DMDAVecRestoreArray(da, c->dev.interior, &_m);   CHKERRQ(ierr);
+  for (l = 0; l < 3; l++)
+  {
+    if (c->abc.width)
+    {
+      ierr = DMDAVecRestoreArray(da, c->dev.g[l], &_g[l]);   CHKERRQ(ierr);
+    }
+  }
+
+  // The owned block of a global Vec starts at rstart, so the offsets of locate_receivers give the global indices
+  PetscInt rstart, r, *idx;
+  ierr = VecGetOwnershipRange(c->dev.interior, &rstart, NULL);   CHKERRQ(ierr);
+  ierr = PetscMalloc1(c->rec.nloc, &idx);   CHKERRQ(ierr);
+  for (r = 0; r < c->rec.nloc; r++)
+  {
+    idx[r] = rstart + c->rec.loc[r];
+  }
+  ierr = ISCreateGeneral(PETSC_COMM_SELF, c->rec.nloc, idx, PETSC_OWN_POINTER, &from);   CHKERRQ(ierr);
+  ierr = ISCreateStride(PETSC_COMM_SELF, c->rec.nloc, 0, 1, &to);   CHKERRQ(ierr);
+  ierr = VecCreateSeq(PETSC_COMM_SELF, c->rec.nloc, &c->dev.rec_u);   CHKERRQ(ierr);
+  ierr = VecScatterCreate(c->dev.interior, from, c->dev.rec_u, to, &c->dev.gather);   CHKERRQ(ierr);
+  ierr = ISDestroy(&from);   CHKERRQ(ierr);
+  ierr = ISDestroy(&to);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// UNIT VECTOR AT THE SOURCE NODE OF THE CURRENT SHOT, ZERO IF IT FALLS ON A BOUNDARY LAYER
+PetscErrorCode
+device_source(void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscScalar *_d;
+  PetscInt p;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  // The owned sources found by source_locate, several of them may share a node
+  ierr = VecSet(c->dev.delta, 0.f);   CHKERRQ(ierr);
+  ierr = VecGetArray(c->dev.delta, &_d);   CHKERRQ(ierr);
+  for (p = 0; p < c->srcs.nloc; p++)
+  {
+    _d[c->srcs.loc[p]] += c->srcs.wloc[p];
+  }
+  ierr = VecRestoreArray(c->dev.delta, &_d);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// WRITE A CHECKPOINT OF THE STATE AFTER STEP c->time.it OF THE CURRENT SHOT, PETSc BINARY THROUGH MPI-IO
+// Header int magic, shot, it, nt, N; then T, T-1, T-2 in natural ordering, and the receiver buffers with
+// the misfit sums of every rank. It = 0 only writes the header, the shot then starts from rest. That marker
+// of a shot being taken goes to its own file, ckpt_g<group>_claim.bin, so it never pushes a state out of the rotation.
+// work is a scratch Vec, the float history of -history_float goes through it
+PetscErrorCode
+checkpoint_write(Vec work, void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscViewer viewer;
+  PetscMPIInt rank;
+  PetscInt N, lag;
+  MPI_Comm comm = PETSC_COMM_WORLD;
+  char buffer[64], latest[64];
+
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt it = c->time.it;
+  PetscInt slot = (it > 0) ? c->ckpt.count % c->ckpt.keep : CKPT_CLAIM_SLOT;
+
+  ierr = VecGetSize(work, &N);   CHKERRQ(ierr);
+  if (slot == CKPT_CLAIM_SLOT) snprintf(buffer, sizeof(buffer), "./checkpoints/ckpt_g%i_claim.bin", c->queue.group);
+  else                         snprintf(buffer, sizeof(buffer), "./checkpoints/ckpt_g%i_%i.bin", c->queue.group, slot);
+
+  ierr = PetscViewerCreate(comm, &viewer);   CHKERRQ(ierr);
+  ierr = PetscViewerSetType(viewer, PETSCVIEWERBINARY);   CHKERRQ(ierr);
+  ierr = PetscViewerBinarySkipInfo(viewer);   CHKERRQ(ierr);
+#if defined(PETSC_HAVE_MPIIO)
+  ierr = PetscViewerBinarySetUseMPIIO(viewer, PETSC_TRUE);   CHKERRQ(ierr);
+#endif
+  ierr = PetscViewerFileSetMode(viewer, FILE_MODE_WRITE);   CHKERRQ(ierr);
+  ierr = PetscViewerFileSetName(viewer, buffer);   CHKERRQ(ierr);
+
+  PetscInt head[5] = {CKPT_FILE_MAGIC, c->shot, it, c->time.nt, N};
+  ierr = PetscViewerBinaryWrite(viewer, head, 5, PETSC_INT, PETSC_FALSE);   CHKERRQ(ierr);
+
+  if (it > 0)
+  {
+    // T-3 is not needed by the next step, so three levels make the whole wavefield state
+    for (lag = 0; lag < 3; lag++)
+    {
+      if (c->wf.single)
+      {
+        PetscInt n, i;
+        PetscScalar *_w;
+        const float *h = WF_HIST(c->wf, it, lag);
+        ierr = VecGetLocalSize(work, &n);   CHKERRQ(ierr);
+        ierr = VecGetArray(work, &_w);   CHKERRQ(ierr);
+        for (i = 0; i < n; i++) _w[i] = h[i];
+        ierr = VecRestoreArray(work, &_w);   CHKERRQ(ierr);
+        ierr = VecView(work, viewer);   CHKERRQ(ierr);
+      }
+      else
+      {
+        ierr = VecView(WF_LEVEL(c->wf, it, lag), viewer);   CHKERRQ(ierr);
+      }
+    }
+
+    // Receiver buffers and misfit sums, in the layout of the ranks that own them
+    Vec state;
+    PetscScalar *_s;
+    PetscInt n = c->rec.nloc * c->rec.nbuf;
+    ierr = VecCreateMPI(comm, n + 2, PETSC_DETERMINE, &state);   CHKERRQ(ierr);
+    ierr = VecGetArray(state, &_s);   CHKERRQ(ierr);
+    ierr = PetscMemcpy(_s, c->rec.trace, n * sizeof(PetscScalar));   CHKERRQ(ierr);
+    _s[n] = c->rec.misfit[0];
+    _s[n + 1] = c->rec.misfit[1];
+    ierr = VecRestoreArray(state, &_s);   CHKERRQ(ierr);
+    ierr = VecView(state, viewer);   CHKERRQ(ierr);
+    ierr = VecDestroy(&state);   CHKERRQ(ierr);
+  }
+  ierr = PetscViewerDestroy(&viewer);   CHKERRQ(ierr);
+
+  // The pointer moves to the new file only once every rank is done with it, and is replaced atomically
+  ierr = MPI_Barrier(comm);   CHKERRQ(ierr);
+  ierr = MPI_Comm_rank(comm, &rank);   CHKERRQ(ierr);
+  if (!rank)
+  {
+    snprintf(latest, sizeof(latest), "./checkpoints/ckpt_g%i.latest", c->queue.group);
+    snprintf(buffer, sizeof(buffer), "%s.tmp", latest);
+    FILE *fout = fopen(buffer, "w");
+    if (!fout) SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_FILE_OPEN, "Cannot open %s", buffer);
+    fprintf(fout, "%i\n", slot);
+    fclose(fout);
+    if (rename(buffer, latest)) SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_FILE_WRITE, "Cannot replace %s", latest);
+  }
+  if (slot != CKPT_CLAIM_SLOT) c->ckpt.count++;
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// OPEN THE LATEST CHECKPOINT OF THIS GROUP AND SET c->shot AND c->time.it0 FROM ITS HEADER
+// viewer is left open for checkpoint_load, or NULL when the group has no checkpoint
+PetscErrorCode
+checkpoint_open(void *ctx, PetscViewer *viewer)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscMPIInt rank;
+  PetscInt slot = -1, head[5], N;
+  MPI_Comm comm = PETSC_COMM_WORLD;
+  char buffer[64];
+
+  ctx_t *c = (ctx_t *) ctx;
+  *viewer = NULL;
+
+  ierr = MPI_Comm_rank(comm, &rank);   CHKERRQ(ierr);
+  if (!rank)
+  {
+    snprintf(buffer, sizeof(buffer), "./checkpoints/ckpt_g%i.latest", c->queue.group);
+    FILE *fin = fopen(buffer, "r");
+    if (fin)
+    {
+      if (fscanf(fin, "%i", &slot) != 1) slot = -1;
+      fclose(fin);
+    }
+  }
+  ierr = MPI_Bcast(&slot, 1, MPIU_INT, 0, comm);   CHKERRQ(ierr);
+  if (slot < 0)
+  {
+    ierr = PetscPrintf(comm, "WARNING: -restart found no checkpoint of group %i, it starts from the first step \n\n", 
+                       c->queue.group); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+  }
+
+  if (slot == CKPT_CLAIM_SLOT) snprintf(buffer, sizeof(buffer), "./checkpoints/ckpt_g%i_claim.bin", c->queue.group);
+  else                         snprintf(buffer, sizeof(buffer), "./checkpoints/ckpt_g%i_%i.bin", c->queue.group, slot);
+  ierr = PetscViewerCreate(comm, viewer);   CHKERRQ(ierr);
+  ierr = PetscViewerSetType(*viewer, PETSCVIEWERBINARY);   CHKERRQ(ierr);
+  ierr = PetscViewerBinarySkipInfo(*viewer);   CHKERRQ(ierr);
+#if defined(PETSC_HAVE_MPIIO)
+  ierr = PetscViewerBinarySetUseMPIIO(*viewer, PETSC_TRUE);   CHKERRQ(ierr);
+#endif
+  ierr = PetscViewerFileSetMode(*viewer, FILE_MODE_READ);   CHKERRQ(ierr);
+  ierr = PetscViewerFileSetName(*viewer, buffer);   CHKERRQ(ierr);
+
+  ierr = PetscViewerBinaryRead(*viewer, head, 5, NULL, PETSC_INT);   CHKERRQ(ierr);
+  ierr = VecGetSize(c->wf.level[0], &N);   CHKERRQ(ierr);
+  if ((head[0] != CKPT_FILE_MAGIC) || (head[3] != c->time.nt) || (head[4] != N) || 
+      (head[1] < 0) || (head[1] >= c->nshots) || (head[2] < 0) || (head[2] >= c->time.nt))
+  {
+    SETERRQ1(comm, PETSC_ERR_FILE_UNEXPECTED, "%s does not match this run, check the grid, -dt, -tmax and -nshots", buffer);
+  }
+
+  c->shot = head[1];
+  c->time.it0 = head[2];
+
+  // The next checkpoint goes to the slot after this one, never over the file .latest names
+  c->ckpt.count = (slot == CKPT_CLAIM_SLOT) ? 0 : slot + 1;
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// RESTORE THE STATE OF THE CHECKPOINT OPENED BY checkpoint_open AND DESTROY ITS VIEWER
+// It runs after the shot was reset, so a checkpoint of step 0 leaves it at rest. The receiver
+// buffers are loaded with the layout they were written in, the run needs the same number of ranks
+PetscErrorCode
+checkpoint_load(PetscViewer viewer, Vec work, void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscInt lag;
+
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt it = c->time.it0;
+
+  if (it > 0)
+  {
+    for (lag = 0; lag < 3; lag++)
+    {
+      if (c->wf.single)
+      {
+        PetscInt n, i;
+        const PetscScalar *_w;
+        float *h = WF_HIST(c->wf, it, lag);
+        ierr = VecLoad(work, viewer);   CHKERRQ(ierr);
+        ierr = VecGetLocalSize(work, &n);   CHKERRQ(ierr);
+        ierr = VecGetArrayRead(work, &_w);   CHKERRQ(ierr);
+        for (i = 0; i < n; i++) h[i] = (float) _w[i];
+        ierr = VecRestoreArrayRead(work, &_w);   CHKERRQ(ierr);
+      }
+      else
+      {
+        ierr = VecLoad(WF_LEVEL(c->wf, it, lag), viewer);   CHKERRQ(ierr);
+      }
+      active_mark(c, WF_SLOT(it, lag), PETSC_TRUE);
+    }
+
+    Vec state;
+    const PetscScalar *_s;
+    PetscInt n = c->rec.nloc * c->rec.nbuf;
+    ierr = VecCreateMPI(PETSC_COMM_WORLD, n + 2, PETSC_DETERMINE, &state);   CHKERRQ(ierr);
+    ierr = VecLoad(state, viewer);   CHKERRQ(ierr);
+    ierr = VecGetArrayRead(state, &_s);   CHKERRQ(ierr);
+    ierr = PetscMemcpy(c->rec.trace, _s, n * sizeof(PetscScalar));   CHKERRQ(ierr);
+    c->rec.misfit[0] = _s[n];
+    c->rec.misfit[1] = _s[n + 1];
+    ierr = VecRestoreArrayRead(state, &_s);   CHKERRQ(ierr);
+    ierr = VecDestroy(&state);   CHKERRQ(ierr);
+  }
+
+  ierr = PetscViewerDestroy(&viewer);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// REPLAY THE FORWARD WAVEFIELD OF THE CURRENT SHOT FROM STEP NT DOWN TO STEP 1
+// Each replayed u is handed to rtm_consume, where the adjoint wavefield would be correlated with it.
+// The rest state before step 1 needs no memory, so all the slots go to the reversal
+PetscErrorCode
+rtm_replay(KSP ksp, Vec b, void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscViewer viewer;
+  char buffer[64];
+
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt its_total = c->solver.its_total;     // The recomputed solves are not part of the forward cost
+  PetscInt nt = c->time.nt;
+
+  c->rtm.steps = 0;
+  c->rtm.deviation = 0.f;
+  ierr = VecSet(c->rtm.illum, 0.f);   CHKERRQ(ierr);
+
+  double begin = MPI_Wtime();
+  ierr = rtm_reverse(ksp, b, c, 0, nt, -1, c->rtm.nslots);   CHKERRQ(ierr);
+  double time_spent = MPI_Wtime() - begin;
+
+  c->solver.its_total = its_total;
+
+  snprintf(buffer, sizeof(buffer), "./wavefields/illumination_shot%i.bin", c->shot);
+  ierr = PetscViewerBinaryOpen(PETSC_COMM_WORLD, buffer, FILE_MODE_WRITE, &viewer);   CHKERRQ(ierr);
+  ierr = VecView(c->rtm.illum, viewer);   CHKERRQ(ierr);
+  ierr = PetscViewerDestroy(&viewer);   CHKERRQ(ierr);
+
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "RTM REPLAY: \t shot %i \t %i states in memory \t %i steps recomputed, "
+                     "%g per step \t %f sec \n", c->shot, c->rtm.nslots, c->rtm.steps, (double) c->rtm.steps / nt, 
+                     time_spent); CHKERRQ(ierr);
+  if (c->rtm.norm)
+  {
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Largest relative |u| difference to the forward pass \t %g \n", 
+                       (double) c->rtm.deviation); CHKERRQ(ierr);
+  }
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\t Illumination written to %s \n\n", buffer); CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// REVERSE THE STEPS (s, e], THE STATE AFTER STEP s IS IN SLOT base (-1 FOR THE REST STATE) AND nfree SLOTS ARE LEFT.
+// With r the fewest recomputations that reverse e - s steps, binomial(nfree, r) >= e - s, the state after step m is
+// stored so that (m, e] can be reversed with one slot less and (s, m] with one recomputation less
+PetscErrorCode
+rtm_reverse(KSP ksp, Vec b, void *ctx, PetscInt s, PetscInt e, PetscInt base, PetscInt nfree)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscInt n = e - s, r, m, t, l;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  // One step, or no slot left: every step is recomputed from the base
+  if ((n == 1) || !nfree)
+  {
+    for (t = e; t > s; t--)
+    {
+      ierr = rtm_restore(c, s, base);   CHKERRQ(ierr);
+      ierr = rtm_advance(ksp, b, c, s, t);   CHKERRQ(ierr);
+      ierr = rtm_consume(b, c);   CHKERRQ(ierr);
+    }
+    PetscFunctionReturn(0);
+  }
+
+  r = 0;
+  while (binomial(nfree, r) < n) r++;
+  m = s + PetscMax(1, n - (PetscInt) PetscMin(binomial(nfree - 1, r), (PetscReal) n));
+
+  // The slots are used as a stack, the deepest level of the recursion holds the last one
+  PetscInt k = c->rtm.nslots - nfree;
+  ierr = rtm_restore(c, s, base);   CHKERRQ(ierr);
+  ierr = rtm_advance(ksp, b, c, s, m);   CHKERRQ(ierr);
+  for (l = 0; l < 3; l++)
+  {
+    ierr = VecCopy(WF_LEVEL(c->wf, m, l), c->rtm.slot[3 * k + l]);   CHKERRQ(ierr);
+  }
+
+  ierr = rtm_reverse(ksp, b, c, m, e, k, nfree - 1);   CHKERRQ(ierr);
+  ierr = rtm_reverse(ksp, b, c, s, m, base, nfree);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// PUT THE STATE AFTER STEP s BACK INTO THE RING, FROM SLOT k OR, FOR k = -1, THE REST STATE OF s = 0
+PetscErrorCode
+rtm_restore(void *ctx, PetscInt s, PetscInt k)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscInt l;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  for (l = 0; l < 3; l++)
+  {
+    if (k < 0)
+    {
+      ierr = VecSet(WF_LEVEL(c->wf, s, l), 0.f);   CHKERRQ(ierr);
+    }
+    else
+    {
+      ierr = VecCopy(c->rtm.slot[3 * k + l], WF_LEVEL(c->wf, s, l));   CHKERRQ(ierr);
+    }
+    active_mark(c, WF_SLOT(s, l), (PetscBool) (k >= 0));
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// RECOMPUTE THE STEPS s + 1 ... e FROM THE STATE AFTER STEP s, WITH THE SAME time_step AS THE FORWARD PASS
+PetscErrorCode
+rtm_advance(KSP ksp, Vec b, void *ctx, PetscInt s, PetscInt e)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscInt it;
+
+  ctx_t *c = (ctx_t *) ctx;
+
+  for (it = s + 1; it <= e; it++)
+  {
+    c->time.it = it;
+    c->time.t = (PetscScalar) (it-1) * c->time.dt;
+    ierr = time_step(ksp, b, c);   CHKERRQ(ierr);
+    c->rtm.steps++;
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// USE THE REPLAYED u OF STEP c->time.it: CHECK IT AGAINST THE FORWARD PASS AND ADD u^2 TO THE ILLUMINATION.
+// work is a scratch Vec, b is free after the step
+PetscErrorCode
+rtm_consume(Vec work, void *ctx)
+{
+  PetscFunctionBegin;
+
+  PetscErrorCode ierr;
+  PetscReal norm, ref;
+
+  ctx_t *c = (ctx_t *) ctx;
+  Vec u = WF_LEVEL(c->wf, c->time.it, 0);
+
+  if (c->rtm.norm)
+  {
+    ierr = VecNorm(u, NORM_2, &norm);   CHKERRQ(ierr);
+    ref = c->rtm.norm[c->time.it - 1];
+    if (ref > 0.f)
+    {
+      c->rtm.deviation = PetscMax(c->rtm.deviation, PetscAbsReal(norm - ref) / ref);
+    }
+  }
+
+  ierr = VecPointwiseMult(work, u, u);   CHKERRQ(ierr);
+  ierr = VecAXPY(c->rtm.illum, 1.f, work);   CHKERRQ(ierr);
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// NUMBER OF STEPS THAT c SLOTS REVERSE WITH AT MOST r RECOMPUTATIONS OF EACH STEP, (c + r)! / (c! r!)
+PetscReal
+binomial(PetscInt c, PetscInt r)
+{
+  PetscReal beta = 1.f;
+  PetscInt i;
+
+  for (i = 1; i <= r; i++)
+  {
+    beta = beta * (c + i) / i;
+  }
+
+  return beta;
+}
+
+
+
+// BOX OF THE NODES THAT THE EXPLICIT STEP c->time.it HAS TO UPDATE
+// The nonzero nodes of T-1 spread by the stencil radius and those of T-2 stay where they are, the source
+// nodes are added, and everything is cut to the reach of the fastest wave, cmax * t / h + margin nodes from
+// the box of the sources. The nodes left out are zero up to the truncation of that reach
+void
+active_box(void *ctx, PetscInt *box)
+{
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt it = c->time.it, rs = c->stencil.radius, a;
+  const PetscInt *b1 = c->active.box[WF_SLOT(it, 1)], *b2 = c->active.box[WF_SLOT(it, 2)];
+  PetscBool e1 = (PetscBool) ((b1[0] >= b1[1]) || (b1[2] >= b1[3]) || (b1[4] >= b1[5]));
+  PetscBool e2 = (PetscBool) ((b2[0] >= b2[1]) || (b2[2] >= b2[3]) || (b2[4] >= b2[5]));
+  const PetscInt *sb = c->srcs.box;
+  PetscScalar h[3] = {c->model.dx, c->model.dy, c->model.dz};
+  PetscScalar t = c->time.t + c->time.dt;
+
+  for (a = 0; a < 3; a++)
+  {
+    PetscInt lo = sb[2 * a], hi = sb[2 * a + 1];
+    if (!e1)
+    {
+      lo = PetscMin(lo, b1[2 * a] - rs);
+      hi = PetscMax(hi, b1[2 * a + 1] + rs);
+    }
+    if (!e2)
+    {
+      lo = PetscMin(lo, b2[2 * a]);
+      hi = PetscMax(hi, b2[2 * a + 1]);
+    }
+    PetscInt reach = (PetscInt) ceil(c->active.cmax * t / h[a]) + c->active.margin;
+    box[2 * a] = PetscMax(PetscMax(lo, sb[2 * a] - reach), 0);
+    box[2 * a + 1] = PetscMax(PetscMin(PetscMin(hi, sb[2 * a + 1] + reach), c->active.n[a]), box[2 * a]);
+  }
+}
+
+
+
+// RECORD THE BOX OF LEVEL slot, EMPTY AFTER IT IS ZEROED, THE WHOLE GRID AFTER IT IS LOADED OR COPIED
+void
+active_mark(void *ctx, PetscInt slot, PetscBool full)
+{
+  ctx_t *c = (ctx_t *) ctx;
+  PetscInt a;
+
+  for (a = 0; a < 3; a++)
+  {
+    c->active.box[slot][2 * a] = 0;
+    c->active.box[slot][2 * a + 1] = full ? c->active.n[a] : 0;
+  }
+}
@@ -0,0 +1,157 @@
+/*
+  Stencil kernels of one spatial order, a template included by p3D_acoustic.c once per order
+
+  Define before including it:
+    STENCIL_ORDER     2, 4, 6 or 8
+    STENCIL_WEIGHTS   {d[0], ..., d[R]}, R = STENCIL_ORDER / 2, with h2 * u'' = d[0] u[0] + sum_m d[m] (u[m] + u[-m])
+
+  It defines stencil_weights_O<order>, explicit_box_O<order> and apply_box_O<order>.
+  The radius and the weights are compile-time constants, so the loops over the taps have fixed trip
+  counts and are unrolled by the compiler. The taps on one side of a node are all skipped when the
+  farthest one reaches the boundary layer, as the original O(2,2) and O(2,4) schemes did
+*/
+
+#ifndef KERNEL
+#define KERNEL_PASTE(name, order) name##_O##order
+#define KERNEL_NAME(name, order) KERNEL_PASTE(name, order)
+#define KERNEL(name) KERNEL_NAME(name, STENCIL_ORDER)
+#endif
+
+#define STENCIL_RADIUS (STENCIL_ORDER / 2)
+
+static const PetscScalar KERNEL(stencil_weights)[STENCIL_RADIUS + 1] = STENCIL_WEIGHTS;
+
+
+
+// LEAPFROG UPDATE OVER box = {xs, xe, ys, ye, zs, ze}, SAME NEIGHBOR RULES AS compute_A_u
+// w holds dt2 / h2 along each axis. The squared velocity is vel2, or _c2 per node when it is not NULL.
+// g holds the sponge profiles, or is NULL
+static PetscErrorCode
+KERNEL(explicit_box)(DMDALocalInfo *grid, const PetscScalar *w, PetscScalar vel2, const PetscScalar ***_c2,
+                     PetscScalar **g, PetscScalar ***_u, const PetscScalar ***_um1, const PetscScalar ***_um2,
+                     const PetscInt *box)
+{
+  PetscFunctionBegin;
+
+  const PetscScalar *d = KERNEL(stencil_weights);
+  PetscScalar wx[STENCIL_RADIUS + 1], wy[STENCIL_RADIUS + 1], wz[STENCIL_RADIUS + 1], w0;
+  PetscInt j, k, t;
+
+  for (t = 0; t <= STENCIL_RADIUS; t++)
+  {
+    wx[t] = w[0] * d[t];
+    wy[t] = w[1] * d[t];
+    wz[t] = w[2] * d[t];
+  }
+  w0 = wx[0] + wy[0] + wz[0];
+
+  OMP_FOR_ROWS
+  for(k = box[4]; k < box[5]; k++)      // Depth
+  {
+    for(j = box[2]; j < box[3]; j++)    // Columns
+    {
+      PetscScalar f, c2, gk;
+      PetscInt i, m;
+      for(i = box[0]; i < box[1]; i++)  // Rows
+      {
+        // Nodes on the boundary layers
+        if((i == 0) || (i == (grid->mx - 1)) ||
+          (j == 0) || (j == (grid->my - 1)) ||
+          (k == 0) || (k == (grid->mz - 1)))
+        {
+          _u[k][j][i] = 0.f;
+          continue;
+        }
+
+        f = w0 * _um1[k][j][i];     // dt2 * Laplacian(um1)
+
+        if((i - STENCIL_RADIUS) > 0)
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wx[m] * _um1[k][j][i - m];
+        if((i + STENCIL_RADIUS) < (grid->mx - 1))
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wx[m] * _um1[k][j][i + m];
+        if((j - STENCIL_RADIUS) > 0)
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wy[m] * _um1[k][j - m][i];
+        if((j + STENCIL_RADIUS) < (grid->my - 1))
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wy[m] * _um1[k][j + m][i];
+        if((k - STENCIL_RADIUS) > 0)
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wz[m] * _um1[k - m][j][i];
+        if((k + STENCIL_RADIUS) < (grid->mz - 1))
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wz[m] * _um1[k + m][j][i];
+
+        c2 = _c2 ? _c2[k][j][i] : vel2;
+        gk = g ? g[0][i] * g[1][j] * g[2][k] : 1.f;
+        _u[k][j][i] = gk * (2.f * _um1[k][j][i] + c2 * f) - gk * gk * _um2[k][j][i];
+      }
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+
+
+// MATRIX-FREE y = h3 x - vel2 * dt2 * h^3 Laplacian(x) OVER THE OWNED NODES, SAME NEIGHBOR RULES AS compute_A_u
+// w holds dt2 * h^3 / h2 along each axis, h3 is the diagonal 2 h^3 and _x the ghosted copy of x
+static PetscErrorCode
+KERNEL(apply_box)(DMDALocalInfo *grid, const PetscScalar *w, PetscScalar h3, PetscScalar vel2,
+                  const PetscScalar ***_c2, const PetscScalar ***_x, PetscScalar ***_y)
+{
+  PetscFunctionBegin;
+
+  const PetscScalar *d = KERNEL(stencil_weights);
+  PetscScalar wx[STENCIL_RADIUS + 1], wy[STENCIL_RADIUS + 1], wz[STENCIL_RADIUS + 1], w0;
+  PetscInt j, k, t;
+
+  for (t = 0; t <= STENCIL_RADIUS; t++)
+  {
+    wx[t] = w[0] * d[t];
+    wy[t] = w[1] * d[t];
+    wz[t] = w[2] * d[t];
+  }
+  w0 = wx[0] + wy[0] + wz[0];
+
+  OMP_FOR_ROWS
+  for(k = grid->zs; k < (grid->zs + grid->zm); k++)          // Depth
+  {
+    for(j = grid->ys; j < (grid->ys + grid->ym); j++)        // Columns
+    {
+      PetscScalar f, c2;
+      PetscInt i, m;
+      for(i = grid->xs; i < (grid->xs + grid->xm); i++)      // Rows
+      {
+        // Nodes on the boundary layers
+        if((i == 0) || (i == (grid->mx - 1)) ||
+          (j == 0) || (j == (grid->my - 1)) ||
+          (k == 0) || (k == (grid->mz - 1)))
+        {
+          _y[k][j][i] = _x[k][j][i];
+          continue;
+        }
+
+        f = w0 * _x[k][j][i];
+
+        if((i - STENCIL_RADIUS) > 0)
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wx[m] * _x[k][j][i - m];
+        if((i + STENCIL_RADIUS) < (grid->mx - 1))
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wx[m] * _x[k][j][i + m];
+        if((j - STENCIL_RADIUS) > 0)
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wy[m] * _x[k][j - m][i];
+        if((j + STENCIL_RADIUS) < (grid->my - 1))
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wy[m] * _x[k][j + m][i];
+        if((k - STENCIL_RADIUS) > 0)
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wz[m] * _x[k - m][j][i];
+        if((k + STENCIL_RADIUS) < (grid->mz - 1))
+          for (m = 1; m <= STENCIL_RADIUS; m++) f += wz[m] * _x[k + m][j][i];
+
+        c2 = _c2 ? _c2[k][j][i] : vel2;
+        _y[k][j][i] = h3 * _x[k][j][i] - c2 * f;
+      }
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+#undef STENCIL_RADIUS
+#undef STENCIL_WEIGHTS
+#undef STENCIL_ORDER
@@ -0,0 +1,15 @@
+#!/bin/bash
+
+# Geometric multigrid on the DMDA hierarchy. Every level is rediscretized by compute_A_u
+# with its own grid spacing, -pc_mg_galerkin forms the coarse operators as R A P instead.
+# -pc_mg_levels can be at most -da_refine + 1 with the default 32^3 coarse mesh.
+
+PETSC_MPIRUN=${PETSC_DIR}/${PETSC_ARCH}/bin/mpirun
+
+rm -rf ./wavefields/tmp*
+rm -rf ./seism/seis*
+
+${PETSC_MPIRUN} -n 2 ./p3D_acoustic.out -order 4 -da_refine 2 -ksp_type gmres -pc_type mg -pc_mg_levels 3 \
+  -mg_levels_ksp_type chebyshev -mg_levels_ksp_max_it 3 -mg_levels_pc_type jacobi \
+  -mg_coarse_ksp_type preonly -mg_coarse_pc_type redundant -mg_coarse_redundant_pc_type lu \
+  -ksp_converged_reason
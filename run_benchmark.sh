@@ -0,0 +1,99 @@
+#!/bin/bash
+
+# Benchmark and scaling sweep of p3D_acoustic over the spatial orders, also run by `make benchmark`.
+# Every run is checked against the analytic homogeneous solution (-check_accuracy) and appends a row to
+#   ./bench/strong.csv - fixed grid (-da_refine $REFINE), growing number of ranks
+#   ./bench/weak.csv   - grid refined once (8x the points) for every 8x the ranks
+# Speedup and efficiency are relative to the first row of the same order and solver.
+# The full output, the per-step table (-log_steps) and the JSON summary of every run are kept in ./bench/logs/.
+# The sweep can be narrowed from the environment, e.g.
+#   ORDERS=4 RANKS="1 2 4" SOLVERS="asm explicit" EXTRA="-tmax 0.5" ./run_benchmark.sh
+# SUFFIX=_opt benchmarks the binaries of `make release` instead of the debug ones, as `make benchmark` does.
+
+PETSC_MPIRUN=${PETSC_MPIRUN:-${PETSC_DIR}/${PETSC_ARCH}/bin/mpirun}
+
+ORDERS=${ORDERS:-"2 4 6 8"}              # -order
+RANKS=${RANKS:-"1 2 4 8"}                 # Strong scaling
+REFINE=${REFINE:-1}
+WEAK=${WEAK:-"1:0 8:1 64:2"}              # Weak scaling, ranks:refine pairs
+SOLVERS=${SOLVERS:-"asm float mg shell explicit"}
+EXTRA=${EXTRA:-""}                        # Options added to every run
+SUFFIX=${SUFFIX:-""}                      # Binary p3D_acoustic${SUFFIX}.out
+
+# Solver options, LEVELS is replaced by -da_refine + 1
+solver_options() {
+  case $1 in
+    asm)      echo "-ksp_type gmres -pc_type asm -pc_asm_overlap 2 -sub_pc_type ilu" ;;
+    mg)       echo "-ksp_type gmres -pc_type mg -pc_mg_levels LEVELS -mg_levels_ksp_type chebyshev \
+                    -mg_levels_ksp_max_it 3 -mg_levels_pc_type jacobi -mg_coarse_ksp_type preonly \
+                    -mg_coarse_pc_type redundant -mg_coarse_redundant_pc_type lu" ;;
+    float)    echo "-ksp_type gmres -pc_type asm -pc_asm_overlap 2 -sub_pc_type ilu -history_float" ;;
+    shell)    echo "-operator shell -ksp_type gmres -pc_type jacobi" ;;
+    explicit) echo "-scheme explicit" ;;
+    *)        echo "unknown solver $1" >&2; exit 1 ;;
+  esac
+}
+
+# NX, time per step, KSP iterations per step, memory per rank and in total, misfit of the last shot
+parse() {
+  awk -F'\t' '
+    BEGIN                     { nx = "nan"; tstep = "nan"; its = 0; mmax = "nan"; mtot = "nan"; misfit = "nan" }
+    /NX [0-9]/                { n = split($0, w, " "); nx = w[n] }
+    /Wall time per step/      { split($3, w, " "); tstep = w[1] }
+    /KSP iterations per step/ { its = $3 + 0 }
+    /Memory high-water mark/  { split($3, w, " "); mmax = w[1]; split($4, w, " "); mtot = w[1] }
+    /relative L2 misfit/      { misfit = $NF + 0 }
+    END                       { printf "%s,%s,%s,%s,%s,%s", nx, tstep, its, mmax, mtot, misfit }' "$1"
+}
+
+HEADER="order,solver,ranks,refine,nx,time_per_step,ksp_its_per_step,mem_per_rank_mb,mem_total_mb,misfit,speedup,efficiency,status"
+
+# run table order solver ranks refine
+run() {
+  local table=$1 order=$2 solver=$3 ranks=$4 refine=$5
+  local name=${table}_O${order}_${solver}_n${ranks}_r${refine}
+  local options=$(solver_options ${solver})
+
+  if [ "${solver}" == "mg" ] && [ ${refine} -lt 1 ]; then
+    return                                # PCMG needs at least one refinement
+  fi
+  options=${options//LEVELS/$((refine + 1))}
+
+  rm -rf ./seism/seis*
+  ${PETSC_MPIRUN} -n ${ranks} ./p3D_acoustic${SUFFIX}.out -order ${order} -da_refine ${refine} -check_accuracy \
+    -log_steps ./bench/logs/${name}.csv -summary_json ./bench/logs/${name}.json ${options} ${EXTRA} > ./bench/logs/${name}.log 2>&1
+  local status=$?
+
+  local row=$(parse ./bench/logs/${name}.log)
+  local tstep=$(echo ${row} | cut -d, -f2)
+  local key=${table}_${order}_${solver}
+  if [ -z "${BASE_T[$key]}" ] && [ ${status} -eq 0 ]; then
+    BASE_T[$key]=${tstep}
+    BASE_N[$key]=${ranks}
+  fi
+
+  # Strong: speedup = t0 / t, efficiency = speedup * n0 / n. Weak: efficiency = t0 / t
+  local scaling=$(awk -v t=${tstep} -v t0=${BASE_T[$key]:-nan} -v n=${ranks} -v n0=${BASE_N[$key]:-1} \
+    -v weak=$([ ${table} == weak ] && echo 1 || echo 0) '
+    BEGIN { if (t0 == "nan" || t == "nan" || t + 0 <= 0) { print "nan,nan"; exit }
+            s = t0 / t; printf "%g,%g", (weak ? s * n / n0 : s), (weak ? s : s * n0 / n) }')
+
+  echo "${order},${solver},${ranks},${refine},${row},${scaling},${status}" | tee -a ./bench/${table}.csv
+}
+
+mkdir -p ./bench/logs ./seism ./wavefields
+declare -A BASE_T BASE_N
+
+echo ${HEADER} > ./bench/strong.csv
+echo ${HEADER} > ./bench/weak.csv
+
+for order in ${ORDERS}; do
+  for solver in ${SOLVERS}; do
+    for ranks in ${RANKS}; do
+      run strong ${order} ${solver} ${ranks} ${REFINE}
+    done
+    for pair in ${WEAK}; do
+      run weak ${order} ${solver} ${pair%:*} ${pair#*:}
+    done
+  done
+done